@@ -0,0 +1,86 @@
+#include <WiFi.h>
+#include "mqttbroker.h"
+
+class MyMQTTBroker: public MQTTBroker {
+  public:
+    // Events
+    void clientConnected(byte i) override;
+    void clientDisconnected(byte i) override;
+    void published(byte i, char *topic, char *data, bool retain) override;
+};
+
+const char wifi_ssid[]     = "SSID";
+const char wifi_password[] = "Password";
+const int  mqtt_port      = 1883;
+
+WiFiServer server(mqtt_port);
+WiFiClient clients[MQTT_BROKER_CONNECTIONS];
+MyMQTTBroker broker;
+unsigned long lastTick = 0;
+long uptime = 0;
+char buffer[12];
+
+void setup() {
+  Serial.begin(115200);
+  Serial.println("Initializing...");
+  WiFi.begin(wifi_ssid, wifi_password);
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(500);
+  }
+  Serial.print("Broker listening on "); Serial.println(WiFi.localIP());
+  server.begin();
+}
+
+void loop() {
+  byte errorCode;
+  int i;
+
+  WiFiClient client = server.available();
+  if (client) {
+    // accept() takes the first free connection, so keep the socket in the same slot
+    for (i=0;(i<MQTT_BROKER_CONNECTIONS) && (broker.connections[i].stream != NULL);i++);
+    if (i == MQTT_BROKER_CONNECTIONS) {
+      Serial.println("No free connections");
+      client.stop();
+    } else {
+      clients[i] = client;
+      broker.accept(&clients[i]);
+    }
+  }
+
+  for (i=0;i<MQTT_BROKER_CONNECTIONS;i++) {
+    if (broker.connections[i].stream == NULL) {
+      continue;
+    }
+    if (!clients[i].connected()) {
+      broker.disconnected(i);
+      clients[i].stop();
+    } else if (clients[i].available() > 1) {
+      errorCode = broker.dataAvailable(i);
+      if (errorCode != MQTT_ERROR_NONE) {
+        Serial.print("Connection "); Serial.print(i); Serial.print(" error code "); Serial.println(errorCode);
+      }
+    }
+  }
+
+  if (millis() - lastTick >= 1000) {
+    lastTick += 1000;
+    broker.intervalTimer();
+    uptime++;
+    broker.publish("hub/uptime",ltoa(uptime,buffer,10),qtAT_MOST_ONCE,true);
+  }
+  broker.poll();
+}
+
+void MyMQTTBroker::clientConnected(byte i) {
+  Serial.print(connections[i].clientID); Serial.println(" connected");
+}
+
+void MyMQTTBroker::clientDisconnected(byte i) {
+  Serial.print("Connection "); Serial.print(i); Serial.println(" closed");
+  clients[i].stop();
+}
+
+void MyMQTTBroker::published(byte i, char *topic, char *data, bool retain) {
+  Serial.print(connections[i].clientID); Serial.print(": "); Serial.print(topic); Serial.print("="); Serial.println(data);
+}
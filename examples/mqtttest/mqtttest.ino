@@ -74,6 +74,7 @@ void loop() {
         a0++; a1++; a2++;
       }
     }
+    mqtt.poll();
     client.flush();  
     delay(100);
   }
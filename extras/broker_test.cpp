@@ -0,0 +1,176 @@
+// Connects several MQTTClients to an MQTTBroker over in memory streams and checks
+// wildcard subscriptions, retained messages, QoS 1 acknowledgement, that a message is
+// sent once to a connection with several matching subscriptions, and that a QoS 2
+// publish closes the connection.
+#include "mqttbroker.h"
+#include <deque>
+#include <string>
+#include <vector>
+
+#define CLIENTS 3
+
+// One direction of a connection
+typedef std::deque<byte> Pipe;
+
+class PipeStream: public Stream {
+  private:
+    Pipe *in;
+    Pipe *out;
+  public:
+    PipeStream(Pipe *i, Pipe *o): in(i), out(o) {}
+    int available() override { return in->size(); }
+    int read() override {
+      if (in->empty()) return -1;
+      int c = in->front();
+      in->pop_front();
+      return c;
+    }
+    int peek() override { return in->empty() ? -1 : in->front(); }
+    size_t write(uint8_t b) override {
+      out->push_back(b);
+      return 1;
+    }
+};
+
+struct Received {
+  std::string topic;
+  std::string data;
+  bool retain;
+};
+
+class TestClient: public MQTTClient {
+  public:
+    std::vector<Received> received;
+    std::vector<byte> subacks;
+    void receiveMessage(char *topic, char *data, bool retain, bool duplicate) override {
+      received.push_back({topic,data,retain});
+    }
+    void subscribed(word packetID, byte resultCode) override {
+      subacks.push_back(resultCode);
+    }
+};
+
+class TestBroker: public MQTTBroker {
+  public:
+    bool closed[MQTT_BROKER_CONNECTIONS] = {};
+    void clientDisconnected(byte i) override {
+      closed[i] = true;
+    }
+};
+
+static Pipe toBroker[CLIENTS];
+static Pipe toClient[CLIENTS];
+static TestClient clients[CLIENTS];
+static TestBroker broker;
+static int connection[CLIENTS];
+
+// Delivers everything in flight until both sides are idle
+static void pump() {
+  bool busy = true;
+
+  while (busy) {
+    busy = false;
+    for (int c=0;c<CLIENTS;c++) {
+      if ((connection[c] >= 0) && (broker.connections[connection[c]].stream != NULL) && !toBroker[c].empty()) {
+        broker.dataAvailable(connection[c]);
+        busy = true;
+      }
+      if (!toClient[c].empty()) {
+        clients[c].dataAvailable();
+        busy = true;
+      }
+    }
+    broker.poll();
+    for (int c=0;c<CLIENTS;c++) {
+      clients[c].poll();
+    }
+  }
+}
+
+static void check(bool ok, const char *what) {
+  if (!ok) {
+    printf("FAIL %s\n",what);
+    exit(1);
+  }
+}
+
+// The messages client c received since the last call
+static std::vector<Received> take(int c) {
+  std::vector<Received> r;
+  r.swap(clients[c].received);
+  return r;
+}
+
+int main() {
+  std::vector<Received> r;
+  char clientID[16];
+
+  for (int c=0;c<CLIENTS;c++) {
+    clients[c].stream = new PipeStream(&toClient[c],&toBroker[c]);
+    connection[c] = broker.accept(new PipeStream(&toBroker[c],&toClient[c]));
+    check(connection[c] >= 0,"accept");
+    snprintf(clientID,sizeof(clientID),"client%d",c);
+    clients[c].connect(clientID,NULL,NULL,true);
+    pump();
+    check(clients[c].isConnected,"connect");
+    check(broker.connections[connection[c]].isConnected,"broker sees connection");
+  }
+
+  // A retained message is stored and sent to later subscribers with the retain flag set
+  check(clients[2].publish((char*)"home/kitchen/temp",(char*)"21.5",qtAT_MOST_ONCE,true),"publish retained");
+  pump();
+  check(clients[0].subscribe(1,(char*)"home/+/temp",qtAT_LEAST_ONCE),"subscribe +");
+  pump();
+  check((clients[0].subacks.size() == 1) && (clients[0].subacks[0] == qtAT_LEAST_ONCE),"SUBACK for +");
+  r = take(0);
+  check((r.size() == 1) && (r[0].topic == "home/kitchen/temp") && (r[0].data == "21.5") && r[0].retain,"retained message on subscribe");
+
+  // Three subscriptions on one connection match the same topic, the message is sent once
+  check(clients[1].subscribe(2,(char*)"home/#",qtAT_MOST_ONCE),"subscribe #");
+  check(clients[1].subscribe(3,(char*)"home/+/temp",qtAT_MOST_ONCE),"subscribe +");
+  check(clients[1].subscribe(4,(char*)"home/hall/temp",qtAT_LEAST_ONCE),"subscribe exact");
+  pump();
+  check(clients[1].subacks.size() == 3,"SUBACKs");
+  take(1);
+  check(clients[2].publish((char*)"home/hall/temp",(char*)"19.0"),"publish");
+  pump();
+  r = take(0);
+  check((r.size() == 1) && (r[0].topic == "home/hall/temp") && !r[0].retain,"+ matches one level");
+  r = take(1);
+  check((r.size() == 1) && (r[0].data == "19.0"),"fan-out once per connection");
+
+  // + does not match more than one level, # matches any number
+  check(clients[2].publish((char*)"home/hall/lamp/state",(char*)"on"),"publish deep");
+  pump();
+  check(take(0).empty(),"+ does not match two levels");
+  r = take(1);
+  check((r.size() == 1) && (r[0].topic == "home/hall/lamp/state"),"# matches several levels");
+  check(take(2).empty(),"no subscription, no message");
+
+  // The broker acknowledges a QoS 1 publish
+  check(clients[2].publish((char*)"home/hall/temp",(char*)"19.5",qtAT_LEAST_ONCE),"publish QoS 1");
+  pump();
+  check(clients[2].ackStats[prNORMAL].count == 1,"PUBACK");
+  check(take(0).size() == 1,"QoS 1 routed");
+  check(take(1).size() == 1,"QoS 1 routed once");
+
+  // QoS 2 is not supported and closes the connection
+  check(clients[2].publish((char*)"home/hall/temp",(char*)"20.0",qtEXACTLY_ONCE),"publish QoS 2");
+  pump();
+  check(broker.closed[connection[2]],"QoS 2 publish closes the connection");
+  check(broker.connections[connection[2]].stream == NULL,"connection freed");
+  check(take(0).empty() && take(1).empty(),"QoS 2 message not routed");
+
+  // The freed connection can be reused
+  clients[2].disconnected();
+  toBroker[2].clear();
+  toClient[2].clear();
+  connection[2] = broker.accept(new PipeStream(&toBroker[2],&toClient[2]));
+  check(connection[2] >= 0,"accept after close");
+  clients[2].connect((char*)"client2",NULL,NULL,true);
+  pump();
+  check(clients[2].isConnected,"reconnect");
+
+  printf("PASS %d clients\n",CLIENTS);
+  return 0;
+}
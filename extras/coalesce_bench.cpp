@@ -0,0 +1,67 @@
+// Stream::write() calls and messages per second for small QoS 0 publishes. The Makefile
+// builds it twice, writing straight to the stream (MQTT_OUTPUT_BUFFER_SIZE 0) and
+// coalescing through a 256 byte output buffer. Every write() is passed on to /dev/null,
+// so each one costs a system call as it would on a socket.
+// Run with: make bench
+#include "mqtt.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PUBLISHES  200000
+
+class CountingStream: public Stream {
+  public:
+    const byte *connack = NULL;
+    int fd = open("/dev/null",O_WRONLY);
+    unsigned long writes = 0;
+    unsigned long bytes = 0;
+    int available() override { return (connack != NULL) && (*connack != 0xFF) ? 1 : 0; }
+    int read() override { return (available() > 0) ? *connack++ : -1; }
+    int peek() override { return (available() > 0) ? *connack : -1; }
+    ~CountingStream() { close(fd); }
+    size_t write(uint8_t b) override {
+      return write(&b,1);
+    }
+    size_t write(const uint8_t *buffer, size_t size) override {
+      writes++;
+      bytes += size;
+      return ::write(fd,buffer,size);
+    }
+};
+
+static const byte connack[] = {0x20,2,0,0,0xFF};
+
+int main() {
+  static const word sizes[] = {8,16,32};
+  constexpr PreparedTopic topic("home/sensor/temp");
+  char data[MQTT_MAX_DATA_LEN+1];
+
+  printf("MQTT_OUTPUT_BUFFER_SIZE %d\n",MQTT_OUTPUT_BUFFER_SIZE);
+  printf("%-8s %14s %14s %12s\n","payload","writes/msg","bytes/write","msg/s");
+  for (word size : sizes) {
+    CountingStream stream;
+    MQTTClient client;
+
+    client.stream = &stream;
+    client.connect((char*)"coalesce_bench",NULL,NULL,true);
+    stream.connack = connack;
+    client.dataAvailable();
+    stream.writes = 0;
+    stream.bytes = 0;
+    memset(data,'7',size);
+    data[size] = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (long i=0;i<PUBLISHES;i++) {
+      if (!client.publish(topic,data)) {
+        printf("publish failed\n");
+        return 1;
+      }
+      client.poll(); // As loop() would
+    }
+    client.flush();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-8u %14.3f %14.1f %12.0f\n",size,double(stream.writes) / PUBLISHES,double(stream.bytes) / stream.writes,PUBLISHES / seconds);
+  }
+  return 0;
+}
@@ -0,0 +1,139 @@
+// Compression ratio against CPU time per message for the built in LZSS codec. Payloads
+// longer than MQTT_MAX_DATA_LEN are marked, the client cannot send them without raising it.
+// Run with: make compression_bench && ./build/compression_bench
+#include "mqtt.h"
+#include <string>
+#include <vector>
+
+struct PayloadSet {
+  const char *name;
+  std::vector<std::string> payloads;
+};
+
+static unsigned long rng = 12345;
+
+static unsigned long nextRandom() {
+  rng = rng * 1103515245UL + 12345UL;
+  return (rng >> 16) & 0x7FFF;
+}
+
+// {"id":"sensor-0042","t":21.37,"h":48.2,...} grown until it reaches size bytes
+static std::string telemetry(size_t size) {
+  static const char *keys[] = {"temp","humidity","pressure","battery","rssi","co2","lux","state"};
+  char field[48];
+  std::string s = "{\"id\":\"sensor-";
+
+  snprintf(field,sizeof(field),"%04lu\"",nextRandom() % 10000);
+  s += field;
+  for (byte i=0;s.size() + 24 < size;i++) {
+    snprintf(field,sizeof(field),",\"%s\":%lu.%02lu",keys[i % 8],nextRandom() % 1000,nextRandom() % 100);
+    s += field;
+  }
+  return s + "}";
+}
+
+static std::string logLine(size_t size) {
+  static const char *words[] = {"connection","to","broker","established","retrying","in","seconds","wifi","rssi","ok"};
+  char stamp[32];
+  std::string s;
+
+  snprintf(stamp,sizeof(stamp),"2026-10-18T12:%02lu:%02lu INFO ",nextRandom() % 60,nextRandom() % 60);
+  s = stamp;
+  while (s.size() < size) {
+    s += words[nextRandom() % 10];
+    s += ' ';
+  }
+  return s.substr(0,size);
+}
+
+static std::string randomText(size_t size) {
+  std::string s;
+
+  while (s.size() < size) {
+    s += char(33 + nextRandom() % 94);
+  }
+  return s;
+}
+
+static double nanosSince(std::chrono::steady_clock::time_point start, size_t count) {
+  return std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+int main() {
+  static const size_t sizes[] = {32,64,128,256,512,1024};
+  std::vector<PayloadSet> sets;
+  std::vector<byte> packed(2048);
+  std::vector<byte> unpacked(2048);
+  const int rounds = 200;
+
+  for (size_t size : sizes) {
+    char name[32];
+    PayloadSet json, text, noise;
+    snprintf(name,sizeof(name),"json %zu",size);
+    json.name = strdup(name);
+    snprintf(name,sizeof(name),"log %zu",size);
+    text.name = strdup(name);
+    snprintf(name,sizeof(name),"random %zu",size);
+    noise.name = strdup(name);
+    for (int i=0;i<100;i++) {
+      json.payloads.push_back(telemetry(size));
+      text.payloads.push_back(logLine(size));
+      noise.payloads.push_back(randomText(size));
+    }
+    sets.push_back(json);
+    sets.push_back(text);
+    sets.push_back(noise);
+  }
+
+  printf("window %d bytes, MQTT_MAX_DATA_LEN %d bytes\n",MQTT_COMPRESSION_WINDOW,MQTT_MAX_DATA_LEN);
+  printf("%-12s %8s %8s %7s %14s %14s %9s\n","payloads","raw","packed","ratio","compress ns","decompress ns","sendable");
+  for (const PayloadSet &set : sets) {
+    unsigned long raw = 0;
+    unsigned long out = 0;
+    word len;
+    const char *sendable = (set.payloads[0].size() <= MQTT_MAX_DATA_LEN) ? "yes" : "no";
+
+    for (const std::string &p : set.payloads) {
+      len = mqttCompress((const byte*)p.data(),p.size(),packed.data(),packed.size());
+      if ((len == 0) || (len >= p.size())) {
+        len = p.size(); // Sent uncompressed
+      } else if ((mqttDecompress(packed.data(),len,unpacked.data(),unpacked.size()) != (long)p.size()) ||
+                 (memcmp(unpacked.data(),p.data(),p.size()) != 0)) {
+        printf("round trip failed for %s\n",set.name);
+        return 1;
+      }
+      raw += p.size();
+      out += len;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r=0;r<rounds;r++) {
+      for (const std::string &p : set.payloads) {
+        mqttCompress((const byte*)p.data(),p.size(),packed.data(),packed.size());
+      }
+    }
+    double compressNs = nanosSince(start,rounds * set.payloads.size());
+
+    std::vector<std::vector<byte> > encoded;
+    for (const std::string &p : set.payloads) {
+      len = mqttCompress((const byte*)p.data(),p.size(),packed.data(),packed.size());
+      if ((len > 0) && (len < p.size())) {
+        encoded.push_back(std::vector<byte>(packed.begin(),packed.begin() + len));
+      }
+    }
+    if (encoded.empty()) {
+      printf("%-12s %8lu %8lu %6.2fx %14.0f %14s %9s\n",set.name,raw,out,double(raw) / out,compressNs,"-",sendable);
+      continue;
+    }
+    start = std::chrono::steady_clock::now();
+    for (int r=0;r<rounds;r++) {
+      for (const std::vector<byte> &e : encoded) {
+        mqttDecompress(e.data(),e.size(),unpacked.data(),unpacked.size());
+      }
+    }
+    double decompressNs = nanosSince(start,rounds * encoded.size());
+
+    printf("%-12s %8lu %8lu %6.2fx %14.0f %14.0f %9s\n",set.name,raw,out,double(raw) / out,compressNs,decompressNs,sendable);
+  }
+  return 0;
+}
@@ -0,0 +1,313 @@
+// Runs MQTTClient against a small test broker over a simulated network and reports how
+// each QoS level copes with latency, a bandwidth cap, lost packets, fragmented packets and
+// a link that goes dead. Everything runs from one virtual clock and a seeded random number
+// generator, so every run gives the same results.
+// Run with: make netsim && ./build/netsim
+#include "mqtt.h"
+#include <deque>
+#include <set>
+#include <vector>
+
+// Virtual time in microseconds. The links deliver whatever is due each time it advances.
+static unsigned long long simNow = 0;
+static void simAdvance(unsigned long long us);
+
+struct LinkConfig {
+  unsigned long latency;       // Milliseconds from send to arrival
+  unsigned long bandwidth;     // Bytes per second, 0 for no limit
+  byte dropPercent;            // Chance that a segment is lost
+  word fragment;               // Bytes per fragment, 0 to deliver segments whole
+  unsigned long fragmentDelay; // Milliseconds between the fragments of a segment
+};
+
+// One direction of a connection. Bytes written at the same moment form a segment, which is
+// dropped as a whole or delivered in order, possibly in fragments.
+class Link {
+  private:
+    struct Fragment {
+      unsigned long long due;
+      std::vector<byte> bytes;
+    };
+    std::vector<byte> segment;
+    unsigned long long segmentStarted = 0;
+    unsigned long long busyUntil = 0;
+    unsigned long long lastDue = 0;
+    std::deque<Fragment> inFlight;
+    unsigned long rng;
+    void send() {
+      unsigned long long start = (segmentStarted > busyUntil) ? segmentStarted : busyUntil;
+      unsigned long long usPerByte = (config.bandwidth > 0) ? 1000000ULL / config.bandwidth : 0;
+      word size = (config.fragment > 0) ? config.fragment : segment.size();
+      size_t sent = 0;
+
+      busyUntil = start + segment.size() * usPerByte;
+      rng = rng * 1103515245UL + 12345UL;
+      if (down || (((rng >> 16) % 100) < config.dropPercent)) {
+        dropped++;
+        segment.clear();
+        return;
+      }
+      for (word n=0;sent < segment.size();n++) {
+        Fragment f;
+        size_t len = (segment.size() - sent < size) ? segment.size() - sent : size;
+        f.bytes.assign(segment.begin() + sent,segment.begin() + sent + len);
+        sent += len;
+        f.due = start + sent * usPerByte + config.latency * 1000ULL + n * config.fragmentDelay * 1000ULL;
+        if (f.due < lastDue) {
+          f.due = lastDue; // Never overtake earlier bytes
+        }
+        lastDue = f.due;
+        inFlight.push_back(f);
+      }
+      segment.clear();
+    }
+  public:
+    LinkConfig config;
+    bool down = false;
+    unsigned long dropped = 0;
+    std::deque<byte> received;
+    Link(const LinkConfig &c, unsigned long seed): rng(seed), config(c) {}
+    void write(byte b) {
+      if (segment.empty()) {
+        segmentStarted = simNow;
+      }
+      segment.push_back(b);
+    }
+    void pump() {
+      if (!segment.empty() && (segmentStarted < simNow)) {
+        send();
+      }
+      while (!inFlight.empty() && (inFlight.front().due <= simNow)) {
+        received.insert(received.end(),inFlight.front().bytes.begin(),inFlight.front().bytes.end());
+        inFlight.pop_front();
+      }
+    }
+};
+
+class SimStream: public Stream {
+  private:
+    Link *in;
+    Link *out;
+  public:
+    SimStream(Link *i, Link *o): in(i), out(o) {}
+    int available() override { return in->received.size(); }
+    int read() override {
+      if (in->received.empty()) return -1;
+      int c = in->received.front();
+      in->received.pop_front();
+      return c;
+    }
+    int peek() override { return in->received.empty() ? -1 : in->received.front(); }
+    size_t write(uint8_t b) override {
+      out->write(b);
+      return 1;
+    }
+};
+
+static Link *links[2];
+
+static void simAdvance(unsigned long long us) {
+  simNow += us;
+  links[0]->pump();
+  links[1]->pump();
+}
+
+class SimClient: public MQTTClient {
+  public:
+    unsigned long clockMillis() override { return simNow / 1000; }
+    unsigned long clockMicros() override { return simNow; }
+    void clockDelay(unsigned long ms) override { simAdvance(ms * 1000ULL); }
+};
+
+// Acknowledges everything it is sent and counts the messages it receives. QoS 2 messages
+// are delivered on arrival and their packet ids held until PUBREL.
+class TestBroker: public MQTTCodec {
+  private:
+    std::set<word> held;
+    bool send(byte header, word packetid) {
+      bool result = writeByte(header);
+      result &= writeRemainingLength(2);
+      result &= writeWord(packetid);
+      return endPacket(result);
+    }
+    void deliver(const char *data) {
+      long seq = strtol(data,NULL,10);
+      if (!seen.insert(seq).second) {
+        duplicates++;
+      } else {
+        lastDelivery = simNow;
+      }
+    }
+  public:
+    std::set<long> seen;
+    unsigned long duplicates = 0;
+    unsigned long long lastDelivery = 0;
+    unsigned long clockMillis() override { return simNow / 1000; }
+    unsigned long clockMicros() override { return simNow; }
+    void clockDelay(unsigned long ms) override { simAdvance(ms * 1000ULL); }
+    byte dataAvailable() {
+      byte b;
+      long rl;
+      word len;
+      word packetid = 0;
+      char data[MQTT_MAX_DATA_LEN+1];
+
+      if (!readByte(&b) || !readRemainingLength(&rl)) {
+        return MQTT_ERROR_INSUFFICIENT_DATA;
+      }
+      switch (b >> 4) {
+        case ptCONNECT:
+          if (!skipData(rl)) return MQTT_ERROR_INSUFFICIENT_DATA;
+          send(0x20,0); // CONNACK, session not present and accepted
+          break;
+        case ptPUBLISH:
+          if (!readWord(&len) || !skipData(len)) return MQTT_ERROR_INSUFFICIENT_DATA;
+          rl -= len + 2;
+          if (b & 6) {
+            if (!readWord(&packetid)) return MQTT_ERROR_INSUFFICIENT_DATA;
+            rl -= 2;
+          }
+          if ((rl > MQTT_MAX_DATA_LEN) || !readData(data,rl)) return MQTT_ERROR_PAYLOAD_INVALID;
+          data[rl] = 0;
+          if ((b & 6) == 4) {
+            if (held.insert(packetid).second) {
+              deliver(data);
+            }
+            send(0x50,packetid); // PUBREC
+          } else {
+            deliver(data);
+            if (b & 2) {
+              send(0x40,packetid); // PUBACK
+            }
+          }
+          break;
+        case ptPUBREL:
+          if (!readWord(&packetid)) return MQTT_ERROR_INSUFFICIENT_DATA;
+          held.erase(packetid);
+          send(0x70,packetid); // PUBCOMP
+          break;
+        case ptPINGREQ:
+          endPacket(writeByte(0xD0) && writeByte(0));
+          break;
+        default:
+          if (!skipData(rl)) return MQTT_ERROR_INSUFFICIENT_DATA;
+      }
+      return MQTT_ERROR_NONE;
+    }
+};
+
+struct Scenario {
+  const char *name;
+  LinkConfig link;
+  unsigned long cutAt; // Seconds until both directions go dead, 0 to never
+};
+
+#define PUBLISH_INTERVAL  50 // Milliseconds between publishes
+#define PUBLISH_SECONDS   30 // Publishing stops after this
+#define RUN_SECONDS      120 // Length of each run
+
+static void run(const Scenario &scenario, byte qos) {
+  Link up(scenario.link,1 + qos);
+  Link down(scenario.link,101 + qos);
+  SimStream clientStream(&down,&up);
+  SimStream brokerStream(&up,&down);
+  SimClient client;
+  TestBroker broker;
+  unsigned long accepted = 0;
+  unsigned long refused = 0;
+  unsigned long errors = 0;
+  unsigned long connects = 1;
+  unsigned long long connectedAt = 0;
+  unsigned long long nextPublish = 0;
+  unsigned long long nextInterval = 1000000;
+  unsigned long long detected = 0;
+  unsigned long long cut = scenario.cutAt * 1000000ULL;
+  char data[MQTT_MAX_DATA_LEN+1];
+  byte err;
+
+  simNow = 0;
+  links[0] = &up;
+  links[1] = &down;
+  client.stream = &clientStream;
+  broker.stream = &brokerStream;
+  client.connect((char*)"netsim",NULL,NULL,true);
+
+  while ((simNow < RUN_SECONDS * 1000000ULL) && (detected == 0)) {
+    simAdvance(1000);
+    // As an application would, try again when the CONNECT or CONNACK was lost
+    if (!client.isConnected && (simNow - connectedAt >= 5000000ULL)) {
+      connectedAt = simNow;
+      connects++;
+      client.connect((char*)"netsim",NULL,NULL,true);
+    }
+    if ((cut > 0) && (simNow >= cut)) {
+      up.down = true;
+      down.down = true;
+    }
+    while (brokerStream.available() > 1) {
+      broker.dataAvailable();
+    }
+    while (clientStream.available() > 1) {
+      if (client.dataAvailable() != MQTT_ERROR_NONE) {
+        errors++;
+      }
+    }
+    if (client.isConnected && (simNow >= nextPublish) && (simNow < PUBLISH_SECONDS * 1000000ULL)) {
+      nextPublish += PUBLISH_INTERVAL * 1000;
+      // Padded to a typical sensor payload size
+      snprintf(data,sizeof(data),"%06lu {\"temp\":21.5,\"humidity\":48}",accepted);
+      if (client.publish((char*)"netsim/sensor",data,qos)) {
+        accepted++;
+      } else {
+        refused++;
+      }
+    }
+    client.poll();
+    if (simNow >= nextInterval) {
+      nextInterval += 1000000;
+      err = client.intervalTimer();
+      if ((err == MQTT_ERROR_NO_PING_RESPONSE) || (err == MQTT_ERROR_PACKET_QUEUE_TIMEOUT)) {
+        if ((cut > 0) && (simNow >= cut)) {
+          detected = simNow;
+        } else {
+          errors++;
+        }
+      }
+    }
+  }
+
+  unsigned long delivered = broker.seen.size();
+  double seconds = (broker.lastDelivery > 0) ? broker.lastDelivery / 1e6 : 1;
+  printf("%-12s %3d %8lu %7lu %9lu %5lu %5lu %8.1f %7lu %8lu %7lu ",scenario.name,qos,accepted,refused,delivered,
+         broker.duplicates,accepted - delivered,delivered / seconds,up.dropped + down.dropped,connects,errors);
+  if (cut == 0) {
+    printf("%9s\n","-");
+  } else if (detected == 0) {
+    printf("%9s\n","never");
+  } else {
+    printf("%8.1fs\n",(detected - cut) / 1e6);
+  }
+}
+
+int main() {
+  static const Scenario scenarios[] = {
+    // name          latency bandwidth drop fragment delay  cut
+    {"clean",        {   20,        0,   0,       0,    0},   0},
+    {"lossy 5%",     {   50,        0,   5,       0,    0},   0},
+    {"lossy 20%",    {   50,        0,  20,       0,    0},   0},
+    {"slow 1kB/s",   {  150,     1000,   0,       0,    0},   0},
+    {"fragmented",   {   20,        0,   0,       5,   10},   0},
+    {"dead at 10s",  {   20,        0,   0,       0,    0},  10},
+  };
+
+  printf("%d byte payloads every %d ms for %d s, %d s runs\n",
+         (int)strlen("000000 {\"temp\":21.5,\"humidity\":48}"),PUBLISH_INTERVAL,PUBLISH_SECONDS,RUN_SECONDS);
+  printf("%-12s %3s %8s %7s %9s %5s %5s %8s %7s %8s %7s %9s\n","scenario","qos","accepted","refused","delivered",
+         "dups","lost","msg/s","dropped","connects","errors","detect");
+  for (const Scenario &scenario : scenarios) {
+    for (byte qos=0;qos<=MQTT_MAX_QOS;qos++) {
+      run(scenario,qos);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+// Time per QoS 0 publish() with a PreparedTopic against the same topic as a plain string.
+// The stream throws the bytes away so only the client's own work is measured.
+// Run with: make prepared_bench && ./build/prepared_bench
+#include "mqtt.h"
+
+#define PUBLISHES 2000000
+
+class NullStream: public Stream {
+  public:
+    const byte *connack = NULL;
+    int available() override { return (connack != NULL) && (*connack != 0xFF) ? 1 : 0; }
+    int read() override { return (available() > 0) ? *connack++ : -1; }
+    int peek() override { return (available() > 0) ? *connack : -1; }
+    size_t write(uint8_t b) override { return 1; }
+    size_t write(const uint8_t *buffer, size_t size) override { return size; }
+};
+
+static const byte connack[] = {0x20,2,0,0,0xFF};
+static NullStream stream;
+static MQTTClient client;
+
+template <typename Topic>
+static double nanosPerPublish(const Topic &topic, char *data) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i=0;i<PUBLISHES;i++) {
+    if (!client.publish(topic,data)) {
+      printf("publish failed\n");
+      exit(1);
+    }
+  }
+  return std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count() / PUBLISHES;
+}
+
+int main() {
+  static const char *topics[] = {"t","home/livingroom/temperature","building/floor3/room312/sensors/environment/temperature/celsius"};
+  char data[] = "21.5";
+
+  client.stream = &stream;
+  client.connect((char*)"prepared_bench",NULL,NULL,true);
+  stream.connack = connack;
+  client.dataAvailable();
+
+  printf("%-6s %14s %14s\n","topic","char* ns","prepared ns");
+  for (const char *t : topics) {
+    char topic[MQTT_MAX_TOPIC_LEN+1];
+    strlcpy(topic,t,sizeof(topic));
+    PreparedTopic prepared(t);
+    double plain = nanosPerPublish((char*)topic,data);
+    double fast = nanosPerPublish(prepared,data);
+    printf("%-6zu %14.1f %14.1f\n",strlen(t),plain,fast);
+  }
+  return 0;
+}
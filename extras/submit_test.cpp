@@ -0,0 +1,132 @@
+// Eight threads submit() messages while the owning thread publishes them to a stream that
+// only accepts a few bytes per poll() and acknowledges QoS 1 messages late, so both the
+// outgoing queue and the output buffer keep filling up. Every message must arrive once and
+// in order, and a high priority message must not wait behind a normal one. Built with
+// -fsanitize=thread by the Makefile.
+#include "mqtt.h"
+#include <atomic>
+#include <string>
+#include <deque>
+#include <vector>
+
+#define PRODUCERS   8
+#define MESSAGES 5000
+
+class SlowStream: public Stream {
+  public:
+    std::deque<byte> in;
+    std::vector<byte> out;
+    size_t budget = 0; // Bytes write() accepts until the next poll
+    int available() override { return in.size(); }
+    int read() override {
+      if (in.empty()) return -1;
+      int c = in.front();
+      in.pop_front();
+      return c;
+    }
+    int peek() override { return in.empty() ? -1 : in.front(); }
+    size_t write(uint8_t b) override {
+      if (budget == 0) return 0;
+      budget--;
+      out.push_back(b);
+      return 1;
+    }
+};
+
+int main() {
+  SlowStream stream;
+  MQTTClient client;
+  std::atomic<int> finished(0);
+  std::vector<std::thread> producers;
+  std::deque<word> unacked;
+  long next[PRODUCERS] = {};
+  long received = 0;
+  long fullQueue = 0;
+  size_t parsed = 0;
+
+  client.stream = &stream;
+  stream.budget = 64;
+  client.connect((char*)"submit_test",NULL,NULL,true);
+  stream.in = {0x20,2,0,0};
+  client.dataAvailable();
+  stream.out.clear();
+
+  for (int p=0;p<PRODUCERS;p++) {
+    producers.emplace_back([&,p] {
+      char topic[16];
+      char data[16];
+      snprintf(topic,sizeof(topic),"test/%d",p);
+      for (long i=0;i<MESSAGES;i++) {
+        snprintf(data,sizeof(data),"%ld",i);
+        while (!client.submit(topic,data,p % 2)) {
+          std::this_thread::yield();
+        }
+      }
+      finished++;
+    });
+  }
+
+  for (long loop=0;(finished < PRODUCERS) || (received < PRODUCERS * MESSAGES);loop++) {
+    stream.budget = 64;
+    client.poll();
+    // Parse every complete PUBLISH written so far
+    while ((parsed + 2 <= stream.out.size()) && (parsed + 2 + stream.out[parsed+1] <= stream.out.size())) {
+      byte header = stream.out[parsed];
+      size_t end = parsed + 2 + stream.out[parsed+1];
+      size_t pos = parsed + 2;
+      word topiclen = (stream.out[pos] << 8) | stream.out[pos+1];
+      int p = stream.out[pos+2+topiclen-1] - '0';
+      pos += 2 + topiclen;
+      if ((header & 0xF0) != 0x30) {
+        printf("FAIL unexpected packet %02x\n",header);
+        exit(1);
+      }
+      if (header & 0x06) {
+        unacked.push_back((stream.out[pos] << 8) | stream.out[pos+1]);
+        pos += 2;
+      }
+      long value = strtol(std::string((char*)&stream.out[pos],end - pos).c_str(),NULL,10);
+      if (value != next[p]) {
+        printf("FAIL producer %d sent %ld, expected %ld\n",p,value,next[p]);
+        exit(1);
+      }
+      next[p]++;
+      received++;
+      parsed = end;
+    }
+    if (unacked.size() >= MQTT_PACKET_QUEUE_SIZE - MQTT_HIGH_PRIORITY_SLOTS) {
+      fullQueue++;
+    }
+    // Acknowledge the oldest message every few loops
+    if ((loop % 3 == 0) && !unacked.empty()) {
+      word id = unacked.front();
+      unacked.pop_front();
+      stream.in.insert(stream.in.end(),{0x40,2,byte(id >> 8),byte(id & 0xFF)});
+      client.dataAvailable();
+    }
+  }
+  for (std::thread &t : producers) {
+    t.join();
+  }
+
+  // With no acknowledgements every normal slot fills and the next normal message waits.
+  // A high priority message submitted after it must still go out.
+  if (client.submit("test/long",std::string(MQTT_MAX_DATA_LEN + 1,'x').c_str(),0)) {
+    printf("FAIL payload longer than MQTT_MAX_DATA_LEN accepted\n");
+    exit(1);
+  }
+  for (int i=0;i<=MQTT_PACKET_QUEUE_SIZE;i++) {
+    client.submit("test/normal","x",1);
+  }
+  client.submit("test/high","x",1,false,prHIGH);
+  stream.out.clear();
+  stream.budget = 1024;
+  client.poll();
+  if (std::string(stream.out.begin(),stream.out.end()).find("test/high") == std::string::npos) {
+    printf("FAIL high priority message held up behind a normal one\n");
+    exit(1);
+  }
+  printf("PASS %ld messages from %d threads, outgoing queue full on %ld polls\n",received,PRODUCERS,fullQueue);
+  printf("waited to be published: normal %lu ms max, high %lu ms max\n",client.submitStats[prNORMAL].maxDelay,client.submitStats[prHIGH].maxDelay);
+  return 0;
+}
@@ -0,0 +1,133 @@
+// Time per topic for mqttValidTopic(), mqttValidFilter(), mqttTopicLevels() and
+// mqttTopicMatches() on a generated set of topics shaped like those seen on a home
+// automation bridge: short sensor topics, zigbee2mqtt device ids, Sparkplug B and long
+// AWS IoT shadow topics, some with UTF-8 level names. The Makefile builds it three times,
+// with SIMD switched off, with the default x86-64 flags (SSE2) and with AVX2. The counts
+// on the last line must be the same for all three.
+// Run with: make bench, or make build/topic_bench_avx2 && ./build/topic_bench_avx2
+#include "mqtt.h"
+#include <string>
+#include <vector>
+
+#define TOPICS 2000
+#define ROUNDS  200
+
+static unsigned long rng = 12345;
+
+static unsigned long nextRandom() {
+  rng = rng * 1103515245UL + 12345UL;
+  return (rng >> 16) & 0x7FFF;
+}
+
+template <size_t N>
+static const char *pick(const char *(&list)[N]) {
+  return list[nextRandom() % N];
+}
+
+static std::string generateTopic() {
+  static const char *rooms[] = {"kitchen","livingroom","bedroom","bathroom","hall","garage","garden","office","attic","cellar"};
+  static const char *devices[] = {"thermostat","motion","door","window","lamp","plug","blind","smoke","leak","sensor1"};
+  static const char *quantities[] = {"temperature","humidity","battery","state","power","energy","illuminance","linkquality"};
+  static const char *suffixes[] = {"availability","set","get"};
+  static const char *groups[] = {"plant1","plant2","warehouse"};
+  static const char *shadows[] = {"update/delta","update/accepted","update/documents","get/accepted"};
+  static const char *utf8[] = {"haus/küche/temperatur","haus/schlafzimmer/luftfeuchtigkeit","家/居間/温度","家/寝室/湿度/センサー1","maison/salle_de_séjour/température"};
+  char topic[MQTT_MAX_TOPIC_LEN+1];
+  unsigned long kind = nextRandom() % 100;
+
+  if (kind < 45) {
+    snprintf(topic,sizeof(topic),"home/%s/%s/%s",pick(rooms),pick(devices),pick(quantities));
+  } else if (kind < 65) {
+    snprintf(topic,sizeof(topic),"zigbee2mqtt/0x00158d%010lx/%s",nextRandom() * 32768UL + nextRandom(),pick(suffixes));
+  } else if (kind < 80) {
+    snprintf(topic,sizeof(topic),"spBv1.0/%s/DDATA/edge%02lu/%s",pick(groups),nextRandom() % 20,pick(devices));
+  } else if (kind < 92) {
+    snprintf(topic,sizeof(topic),"$aws/things/%s-%s-%04lu/shadow/%s",pick(rooms),pick(devices),nextRandom() % 10000,pick(shadows));
+  } else {
+    snprintf(topic,sizeof(topic),"%s",pick(utf8));
+  }
+  return topic;
+}
+
+// Subscriptions a bridge or dashboard would typically hold
+static const char *filters[] = {
+  "home/+/+/temperature",
+  "home/kitchen/#",
+  "home/+/motion/state",
+  "zigbee2mqtt/+/availability",
+  "zigbee2mqtt/#",
+  "spBv1.0/+/DDATA/+/+",
+  "spBv1.0/plant1/#",
+  "$aws/things/+/shadow/update/delta",
+  "haus/#",
+  "家/+/温度",
+  "+/+/+/+",
+  "#",
+};
+
+static double nanosSince(std::chrono::steady_clock::time_point start, size_t count) {
+  return std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+}
+
+int main() {
+  std::vector<std::string> topics;
+  word starts[16];
+  unsigned long valid = 0;
+  unsigned long levels = 0;
+  unsigned long matches = 0;
+  size_t bytes = 0;
+  const size_t filterCount = sizeof(filters) / sizeof(filters[0]);
+  std::chrono::steady_clock::time_point start;
+
+  for (int i=0;i<TOPICS;i++) {
+    topics.push_back(generateTopic());
+    bytes += topics.back().size();
+  }
+
+#if defined(__AVX2__)
+  printf("AVX2");
+#elif defined(__SSE2__)
+  printf("SSE2");
+#else
+  printf("scalar");
+#endif
+  printf(", %d topics averaging %zu bytes, %zu filters\n",TOPICS,bytes / TOPICS,filterCount);
+  printf("%-24s %10s\n","operation","ns/topic");
+
+  start = std::chrono::steady_clock::now();
+  for (int r=0;r<ROUNDS;r++) {
+    for (const std::string &t : topics) {
+      valid += mqttValidTopic(t.data(),t.size());
+    }
+  }
+  printf("%-24s %10.1f\n","mqttValidTopic",nanosSince(start,ROUNDS * topics.size()));
+
+  start = std::chrono::steady_clock::now();
+  for (int r=0;r<ROUNDS;r++) {
+    for (const std::string &t : topics) {
+      valid += mqttValidFilter(t.data(),t.size());
+    }
+  }
+  printf("%-24s %10.1f\n","mqttValidFilter",nanosSince(start,ROUNDS * topics.size()));
+
+  start = std::chrono::steady_clock::now();
+  for (int r=0;r<ROUNDS;r++) {
+    for (const std::string &t : topics) {
+      levels += mqttTopicLevels(t.data(),t.size(),starts,16);
+    }
+  }
+  printf("%-24s %10.1f\n","mqttTopicLevels",nanosSince(start,ROUNDS * topics.size()));
+
+  start = std::chrono::steady_clock::now();
+  for (int r=0;r<ROUNDS;r++) {
+    for (const std::string &t : topics) {
+      for (const char *f : filters) {
+        matches += mqttTopicMatches(f,strlen(f),t.data(),t.size());
+      }
+    }
+  }
+  printf("%-24s %10.1f\n","mqttTopicMatches x12",nanosSince(start,ROUNDS * topics.size()));
+
+  printf("valid %lu, levels %lu, matches %lu\n",valid / ROUNDS,levels / ROUNDS,matches / ROUNDS);
+  return 0;
+}
@@ -1,15 +1,39 @@
+#ifndef MQTT_H
+#define MQTT_H
+
 #include <Arduino.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define MQTT_DEFAULT_PING_INTERVAL               30 // Number of seconds between pings
 #define MQTT_DEFAULT_PING_RETRY_INTERVAL          6 // Frequency of pings in seconds after a failed ping response.
 #define MQTT_DEFAULT_KEEPALIVE                   60 // Number of seconds of inactivity before disconnect
 #define MQTT_MAX_TOPIC_LEN                       64 // Bytes
 #define MQTT_MAX_DATA_LEN                        64 // Bytes
+#define MQTT_RECEIVE_BUFFER_SIZE                512 // Bytes. Holds QoS 2 messages until PUBREL plus room for one more message, each topic + data + 2 bytes
 #define MQTT_PACKET_QUEUE_SIZE                    8
 #define MQTT_MIN_PACKETID                       256 // The first 256 packet IDs are reserved for subscribe/unsubscribe packet ids
 #define MQTT_MAX_PACKETID                     65535
-#define MQTT_PACKET_TIMEOUT                       3 // Number of seconds before a packet is resent
-#define MQTT_PACKET_RETRIES                       2 // Number of retry attempts to send a packet before the connection is considered dead
+#define MQTT_PACKET_TIMEOUT                       3 // Number of seconds before a packet is resent, until round trip times have been measured
+#define MQTT_PACKET_RETRIES                       2 // The connection is considered dead when a packet is unacknowledged for MQTT_PACKET_TIMEOUT * MQTT_PACKET_RETRIES seconds
+#define MQTT_MIN_RETRY_TIMEOUT                  200 // Milliseconds. Lower bound of the measured retry timeout
+#define MQTT_MAX_RETRY_TIMEOUT                60000 // Milliseconds. Upper bound of the retry timeout after backing off
+#define MQTT_HIGH_PRIORITY_SLOTS                  2 // Outgoing queue entries only high priority QoS 1 and 2 messages may use
+#define MQTT_QOS2                                 1 // Set to 0 to leave out QoS 2 support
+#define MQTT_QOS2_EARLY_DELIVERY                  0 // Set to 1 to deliver QoS 2 messages on arrival and only keep their packet id until PUBREL
+#define MQTT_WILL_MESSAGE                         1 // Set to 0 to leave out will message support
+#define MQTT_RETRIES                              1 // Set to 0 to leave out resending of unacknowledged packets
+#define MQTT_CACHE_ENTRIES                        0 // Number of topics whose last received value is kept for getCached(), 0 to disable
+#define MQTT_RATE_LIMITS                          0 // Number of topics that can have a publish rate limit, 0 to disable
+#define MQTT_LOCAL_SUBSCRIPTIONS                  0 // Number of subscriptions that also receive this client's own publishes directly, 0 to disable
+#define MQTT_LOCAL_ECHOES                         8 // Number of locally delivered messages whose copy from the broker is still expected
+#define MQTT_OUTPUT_BUFFER_SIZE                   0 // Bytes queued for output. Must hold the largest packet. 0 to write directly to the stream
+#define MQTT_DEFAULT_COALESCE_INTERVAL         2000 // Number of microseconds coalesced publishes may wait before they are flushed
+#define MQTT_SUBMISSION_QUEUE_SIZE                0 // Power of two number of messages other threads can submit(), 0 to disable. Needs <atomic>
+#define MQTT_COMPRESSION                          0 // Set to 1 to compile in the payload compression codec
+#define MQTT_COMPRESSION_MARKER                0x1B // First byte of a compressed payload
+#define MQTT_COMPRESSION_WINDOW                 255 // Bytes of history searched for matches (max 255)
 
 #define ptBROKERCONNECT                           0
 #define ptCONNECT                                 1
@@ -31,6 +55,25 @@
 #define qtAT_LEAST_ONCE                           1
 #define qtEXACTLY_ONCE                            2 
 
+#define rtWAIT                                    0
+#define rtRESEND                                  1
+#define rtEXPIRED                                 2
+
+#define prNORMAL                                  0
+#define prHIGH                                    1
+
+// Milliseconds a packet may go unacknowledged. RetryTimer counts them in a word.
+#define MQTT_RETRY_LIMIT     ((unsigned long)MQTT_PACKET_TIMEOUT * MQTT_PACKET_RETRIES * 1000)
+#if MQTT_RETRIES || (MQTT_LOCAL_SUBSCRIPTIONS > 0)
+static_assert(MQTT_RETRY_LIMIT <= 65535,"MQTT_PACKET_TIMEOUT * MQTT_PACKET_RETRIES must not exceed 65 seconds");
+#endif
+
+#if MQTT_QOS2
+#define MQTT_MAX_QOS                 qtEXACTLY_ONCE
+#else
+#define MQTT_MAX_QOS                qtAT_LEAST_ONCE
+#endif
+
 #define MQTT_CONNACK_SUCCESS                      0
 #define MQTT_CONNACK_UNACCEPTABLE_PROTOCOL        1
 #define MQTT_CONNACK_CLIENTID_REJECTED            2
@@ -70,6 +113,7 @@
 
 #define MQTT_ERROR_UNKNOWN                      255 
 
+#if MQTT_WILL_MESSAGE
 struct WillMessage {
   char topic[MQTT_MAX_TOPIC_LEN+1];
   char data[MQTT_MAX_DATA_LEN+1];
@@ -77,35 +121,490 @@ struct WillMessage {
   bool retain;
   byte qos;  
 };
+#endif
+
+struct RetryTimer {
+  word sent;    // Low 16 bits of clockMillis() when the packet was last sent
+  word timeout; // Milliseconds to wait for the acknowledgement, doubled on each resend
+  word waited;  // Milliseconds waited in total
+  byte retries;
+};
 
 struct PublishMessage {
   word packetid;
-  byte timeout;
-  byte retries;
+  RetryTimer retry;
   byte qos;
+  byte priority;
   bool retain;
   bool duplicate;
+  unsigned long firstSent; // clockMillis() when the message was first sent
   char topic[MQTT_MAX_TOPIC_LEN+1];
   char data[MQTT_MAX_DATA_LEN+1];
 };
 
+struct LatencyStats {
+  unsigned long count;      // Messages measured
+  unsigned long totalDelay; // Milliseconds
+  unsigned long maxDelay;
+};
+
+inline void mqttRecordLatency(LatencyStats *stats, unsigned long delay) {
+  stats->count++;
+  stats->totalDelay += delay;
+  if (delay > stats->maxDelay) {
+    stats->maxDelay = delay;
+  }
+}
+
 struct PacketMessage {
   word packetid;
-  byte timeout;
-  byte retries;
+  RetryTimer retry;
 };
 
-class MQTTClient {
-  private:
-    PublishMessage outgoingPUBLISHQueue[MQTT_PACKET_QUEUE_SIZE];
-    PublishMessage  incomingPUBLISHQueue[MQTT_PACKET_QUEUE_SIZE];
-    PacketMessage  PUBRELQueue[MQTT_PACKET_QUEUE_SIZE];
-    byte incomingPUBLISHQueueCount;
-    byte outgoingPUBLISHQueueCount;
-    byte PUBRELQueueCount;
-    word nextPacketID = MQTT_MIN_PACKETID;
-    int  pingIntervalRemaining;
-    byte pingCount;
+constexpr word mqttStrLen(const char *str, word len = 0) {
+  return (*str == 0) ? len : mqttStrLen(str + 1,len + 1);
+}
+
+// A topic with its length prefix encoded ahead of time, for topics that are published
+// over and over. Declare it constexpr to build it at compile time from a string literal.
+// The topic string must outlive the PreparedTopic.
+struct PreparedTopic {
+  const char *topic;
+  word length;
+  byte header[2];
+  constexpr PreparedTopic(const char *str, word len) : topic(str), length(len), header{byte(len >> 8), byte(len & 0xFF)} {}
+  constexpr PreparedTopic(const char *str) : PreparedTopic(str,mqttStrLen(str)) {}
+};
+
+// 16 bit FNV-1a
+word mqttHash(const char *str, word len) {
+  unsigned long hash = 2166136261UL;
+  
+  while (len-- > 0) {
+    hash ^= byte(*str++);
+    hash *= 16777619UL;
+  }
+  return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+// Topic names and filters, MQTT 3.1.1 section 4.7. On x86 hosts the byte scans look at
+// 16 or 32 bytes at a time, everywhere else they run one byte at a time.
+
+#if defined(__AVX2__)
+// True when none of the 32 bytes at p is non-ASCII, NUL, a or b
+inline bool mqttPlain32(const byte *p, char a, char b) {
+  __m256i v = _mm256_loadu_si256((const __m256i*)p);
+  __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_setzero_si256()),
+    _mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8(a)),_mm256_cmpeq_epi8(v,_mm256_set1_epi8(b))));
+  return _mm256_movemask_epi8(_mm256_or_si256(v,hit)) == 0;
+}
+#endif
+
+#if defined(__SSE2__)
+inline bool mqttPlain16(const byte *p, char a, char b) {
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v,_mm_setzero_si128()),
+    _mm_or_si128(_mm_cmpeq_epi8(v,_mm_set1_epi8(a)),_mm_cmpeq_epi8(v,_mm_set1_epi8(b))));
+  return _mm_movemask_epi8(_mm_or_si128(v,hit)) == 0;
+}
+#endif
+
+// Index of the first a or b in str at or after from, or len if there is none
+word mqttFind(const char *str, word from, word len, char a, char b) {
+  word i = from;
+  
+#if defined(__SSE2__)
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  while (len - i >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(str + i));
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v,va),_mm_cmpeq_epi8(v,vb)));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+    i += 16;
+  }
+#endif
+  while ((i < len) && (str[i] != a) && (str[i] != b)) {
+    i++;
+  }
+  return i;
+}
+
+// End of the topic level that starts at from
+word mqttLevelEnd(const char *topic, word from, word len) {
+  return mqttFind(topic,from,len,'/','/');
+}
+
+// Splits a topic into levels. Fills in the offset each level starts at and returns the
+// number of levels, which may be more than maxLevels.
+word mqttTopicLevels(const char *topic, word len, word *starts, word maxLevels) {
+  word count = 1;
+  word i = 0;
+  
+  if (maxLevels > 0) {
+    starts[0] = 0;
+  }
+#if defined(__SSE2__)
+  __m128i slash = _mm_set1_epi8('/');
+  while (len - i >= 16) {
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(topic + i)),slash));
+    while (mask != 0) {
+      if (count < maxLevels) {
+        starts[count] = i + __builtin_ctz(mask) + 1;
+      }
+      count++;
+      mask &= mask - 1;
+    }
+    i += 16;
+  }
+#endif
+  for (;i<len;i++) {
+    if (topic[i] == '/') {
+      if (count < maxLevels) {
+        starts[count] = i + 1;
+      }
+      count++;
+    }
+  }
+  return count;
+}
+
+// Length of the well formed UTF-8 character at str, or 0 if it is malformed, overlong,
+// a surrogate or U+0000
+byte mqttUTF8Length(const byte *str, word len) {
+  unsigned long cp;
+  byte n;
+  
+  if (str[0] < 0x80) {
+    return (str[0] == 0) ? 0 : 1;
+  } else if ((str[0] >= 0xC2) && (str[0] <= 0xDF)) {
+    n = 2;
+    cp = str[0] & 0x1F;
+  } else if ((str[0] & 0xF0) == 0xE0) {
+    n = 3;
+    cp = str[0] & 0x0F;
+  } else if ((str[0] >= 0xF0) && (str[0] <= 0xF4)) {
+    n = 4;
+    cp = str[0] & 0x07;
+  } else {
+    return 0;
+  }
+  if (len < n) {
+    return 0;
+  }
+  for (byte k=1;k<n;k++) {
+    if ((str[k] & 0xC0) != 0x80) {
+      return 0;
+    }
+    cp = (cp << 6) | (str[k] & 0x3F);
+  }
+  if ((n == 3) && ((cp < 0x800) || ((cp >= 0xD800) && (cp <= 0xDFFF)))) {
+    return 0;
+  }
+  if ((n == 4) && ((cp < 0x10000) || (cp > 0x10FFFF))) {
+    return 0;
+  }
+  return n;
+}
+
+// Checks the UTF-8 and, in a filter, that + and # fill a whole level and # is the last
+// level. Topic names may not contain wildcards at all.
+bool mqttValidName(const char *name, word len, bool filter) {
+  const byte *s = (const byte*)name;
+  word i = 0;
+  byte n;
+  
+  if (len == 0) {
+    return false;
+  }
+  while (i < len) {
+#if defined(__AVX2__)
+    if ((len - i >= 32) && mqttPlain32(s + i,'+','#')) {
+      i += 32;
+      continue;
+    }
+#endif
+#if defined(__SSE2__)
+    if ((len - i >= 16) && mqttPlain16(s + i,'+','#')) {
+      i += 16;
+      continue;
+    }
+#endif
+    if ((s[i] > 0) && (s[i] < 0x80) && (s[i] != '+') && (s[i] != '#')) {
+      i++;
+    } else if ((s[i] == '+') || (s[i] == '#')) {
+      if (!filter || ((i > 0) && (s[i-1] != '/'))) {
+        return false;
+      }
+      if ((s[i] == '#') ? (i + 1 != len) : ((i + 1 < len) && (s[i+1] != '/'))) {
+        return false;
+      }
+      i++;
+    } else {
+      n = mqttUTF8Length(s + i,len - i);
+      if (n == 0) {
+        return false;
+      }
+      i += n;
+    }
+  }
+  return true;
+}
+
+bool mqttValidTopic(const char *topic, word len) {
+  return mqttValidName(topic,len,false);
+}
+
+bool mqttValidTopic(const char *topic) {
+  return mqttValidName(topic,strlen(topic),false);
+}
+
+bool mqttValidFilter(const char *filter, word len) {
+  return mqttValidName(filter,len,true);
+}
+
+bool mqttValidFilter(const char *filter) {
+  return mqttValidName(filter,strlen(filter),true);
+}
+
+// Matches a valid topic against a valid subscription filter that may contain + and #
+// wildcards. A topic never contains + or #, so the two are compared until they differ
+// and only then is the filter checked for a wildcard.
+bool mqttTopicMatches(const char *filter, word filterlen, const char *topic, word topiclen) {
+  word f = 0;
+  word t = 0;
+  
+  // Topics starting with $ are not matched by filters starting with a wildcard
+  if ((topiclen > 0) && (topic[0] == '$') && (filterlen > 0) && ((filter[0] == '+') || (filter[0] == '#'))) {
+    return false;
+  }
+  while (true) {
+#if defined(__SSE2__)
+    while ((filterlen - f >= 16) && (topiclen - t >= 16)) {
+      __m128i same = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(filter + f)),_mm_loadu_si128((const __m128i*)(topic + t)));
+      unsigned int mask = _mm_movemask_epi8(same) ^ 0xFFFF;
+      if (mask != 0) {
+        f += __builtin_ctz(mask);
+        t += __builtin_ctz(mask);
+        break;
+      }
+      f += 16;
+      t += 16;
+    }
+#endif
+    while ((f < filterlen) && (t < topiclen) && (filter[f] == topic[t])) {
+      f++;
+      t++;
+    }
+    if (f == filterlen) {
+      return (t == topiclen);
+    }
+    if (filter[f] == '#') {
+      return true;
+    }
+    if (filter[f] == '+') {
+      t = mqttLevelEnd(topic,t,topiclen);
+      f++;
+      continue;
+    }
+    // "a/#" also matches "a"
+    return (t == topiclen) && (filterlen - f == 2) && (filter[f] == '/') && (filter[f+1] == '#');
+  }
+}
+
+bool mqttTopicMatches(const char *filter, const char *topic) {
+  return mqttTopicMatches(filter,strlen(filter),topic,strlen(topic));
+}
+
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+struct LocalSubscription {
+  word packetid;
+  bool subacked; // Messages are only delivered locally once the broker has accepted it
+  char filter[MQTT_MAX_TOPIC_LEN+1]; // Empty if the entry is unused
+};
+
+struct LocalEcho {
+  word hash;
+  word sent; // Low 16 bits of clockMillis() when the message was delivered locally
+};
+#endif
+
+#if MQTT_CACHE_ENTRIES > 0
+struct CachedMessage {
+  word hash;
+  word datalen;
+  unsigned long lastUsed; // An empty entry has lastUsed 0
+  char topic[MQTT_MAX_TOPIC_LEN+1];
+  char data[MQTT_MAX_DATA_LEN+1];
+};
+#endif
+
+#if MQTT_RATE_LIMITS > 0
+// Token bucket for one topic. A publish made without a token is held here, replacing
+// any earlier held value, and is sent once a token is available.
+struct RateLimit {
+  word hash;
+  word interval;          // Milliseconds to earn a token, 0 if the entry is unused
+  byte burst;             // Maximum number of tokens
+  byte tokens;
+  unsigned long refilled; // clockMillis() when the last token was earned
+  bool pending;
+  byte qos;
+  byte priority;
+  bool retain;
+  char topic[MQTT_MAX_TOPIC_LEN+1];
+  char data[MQTT_MAX_DATA_LEN+1];
+};
+#endif
+
+// A QoS 2 message waiting for PUBREL. The topic and data stay in the receive buffer.
+struct ReceivedMessage {
+  word packetid;
+  word offset;
+  word topiclen;
+  word datalen;
+#if MQTT_RETRIES
+  RetryTimer retry;
+#endif
+  bool retain;
+  bool duplicate;
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+  bool echo; // Already delivered locally, so it is not delivered at PUBREL
+#endif
+};
+
+#if MQTT_SUBMISSION_QUEUE_SIZE > 0
+#include <atomic>
+
+static_assert((MQTT_SUBMISSION_QUEUE_SIZE & (MQTT_SUBMISSION_QUEUE_SIZE - 1)) == 0,"MQTT_SUBMISSION_QUEUE_SIZE must be a power of two");
+
+struct SubmittedMessage {
+  std::atomic<size_t> sequence;
+  unsigned long submitted; // clockMillis() when submit() was called
+  byte qos;
+  bool retain;
+  char topic[MQTT_MAX_TOPIC_LEN+1];
+  char data[MQTT_MAX_DATA_LEN+1];
+};
+
+// Bounded lock free queue. Producers claim a cell with a CAS on head, the I/O thread owns
+// tail. A cell's sequence tells whose turn it is to use it.
+struct SubmissionQueue {
+  SubmittedMessage cells[MQTT_SUBMISSION_QUEUE_SIZE];
+  std::atomic<size_t> head;
+  size_t tail;
+};
+#endif
+
+#if MQTT_COMPRESSION
+// LZSS style codec. A compressed payload is the marker byte followed by groups of
+// a flag byte and up to 8 tokens. A set flag bit is a match encoded as two bytes
+// (offset back into the output, length - 3), a clear bit is a literal byte.
+// Returns the compressed length or 0 if the result would not fit in maxLen.
+word mqttCompress(const byte* src, word len, byte* dst, word maxLen) {
+  word in = 0;
+  word out = 1;
+  word flagPos = 0;
+  byte flagBit = 0;
+
+  if (maxLen == 0) {
+    return 0;
+  }
+  dst[0] = MQTT_COMPRESSION_MARKER;
+  while (in < len) {
+    if (flagBit == 0) {
+      if (out >= maxLen) {
+        return 0;
+      }
+      flagPos = out++;
+      dst[flagPos] = 0;
+      flagBit = 1;
+    }
+    word bestLen = 0;
+    word bestOffset = 0;
+    word start = (in > MQTT_COMPRESSION_WINDOW) ? in - MQTT_COMPRESSION_WINDOW : 0;
+    for (word j=start;j<in;j++) {
+      word l = 0;
+      while ((in + l < len) && (l < 258) && (src[j+l] == src[in+l])) {
+        l++;
+      }
+      if (l > bestLen) {
+        bestLen = l;
+        bestOffset = in - j;
+      }
+    }
+    if (bestLen >= 3) {
+      if (out + 2 > maxLen) {
+        return 0;
+      }
+      dst[flagPos] |= flagBit;
+      dst[out++] = bestOffset;
+      dst[out++] = bestLen - 3;
+      in += bestLen;
+    } else {
+      if (out >= maxLen) {
+        return 0;
+      }
+      dst[out++] = src[in++];
+    }
+    flagBit <<= 1;
+  }
+  return out;
+}
+
+// Returns the decompressed length or -1 if the data is not a valid compressed payload
+// or does not fit in maxLen.
+long mqttDecompress(const byte* src, word len, byte* dst, word maxLen) {
+  word in = 1;
+  word out = 0;
+  byte flags = 0;
+  byte flagBit = 0;
+
+  if ((len == 0) || (src[0] != MQTT_COMPRESSION_MARKER)) {
+    return -1;
+  }
+  while (in < len) {
+    if (flagBit == 0) {
+      flags = src[in++];
+      flagBit = 1;
+      continue;
+    }
+    if (flags & flagBit) {
+      if (in + 2 > len) {
+        return -1;
+      }
+      word offset = src[in++];
+      word l = src[in++] + 3;
+      if ((offset == 0) || (offset > out) || (out + l > maxLen)) {
+        return -1;
+      }
+      while (l-- > 0) {
+        dst[out] = dst[out - offset];
+        out++;
+      }
+    } else {
+      if (out >= maxLen) {
+        return -1;
+      }
+      dst[out++] = src[in++];
+    }
+    flagBit <<= 1;
+  }
+  return out;
+}
+#endif
+
+// Reads and writes MQTT packets on a stream. Shared by MQTTClient and MQTTBroker.
+class MQTTCodec {
+  protected:
+#if MQTT_OUTPUT_BUFFER_SIZE > 0
+    byte outputBuffer[MQTT_OUTPUT_BUFFER_SIZE];
+    word outputLength = 0;    // Bytes in outputBuffer
+    word outputCommitted = 0; // Bytes in outputBuffer that belong to complete packets
+    bool outputFlushing = false;
+    unsigned long outputStarted;
+#endif
     //
     bool readByte(byte* b);
     bool writeByte(const byte b);    
@@ -114,19 +613,112 @@ class MQTTClient {
     bool readRemainingLength(long *value);
     bool writeRemainingLength(const long value);
     bool readData(char* data, const word len);
-    bool writeData(char* data, const word len);
+    bool writeData(const char* data, const word len);
     bool writeStr(char* str);
     bool readStr(char* str, const word len);
+    bool skipData(long len);
+    bool endPacket(bool result, bool coalesce = false);
+  public:
+    Stream* stream;
+    // Clock. Override these to run from a simulated clock.
+    virtual unsigned long clockMillis() { return millis(); };
+    virtual unsigned long clockMicros() { return micros(); };
+    virtual void clockDelay(unsigned long ms) { delay(ms); };
+    bool flush();         // Writes out any buffered packets immediately
+    word outputPending(); // Number of bytes the stream has not accepted yet
+    bool poll();          // Flushes coalesced packets once coalesceInterval has passed
+#if MQTT_OUTPUT_BUFFER_SIZE > 0
+    unsigned long coalesceInterval = MQTT_DEFAULT_COALESCE_INTERVAL;
+#endif
+};
+
+class MQTTClient: public MQTTCodec {
+  private:
+#if MQTT_RETRIES
+    PublishMessage outgoingPUBLISHQueue[MQTT_PACKET_QUEUE_SIZE];
+    byte outgoingPUBLISHQueueCount;
+#endif
+#if MQTT_QOS2 && !MQTT_QOS2_EARLY_DELIVERY
+    ReceivedMessage incomingPUBLISHQueue[MQTT_PACKET_QUEUE_SIZE];
+    byte incomingPUBLISHQueueCount;
+    word receiveHead;   // End of the newest message held in receiveBuffer
+    byte receiveBuffer[MQTT_RECEIVE_BUFFER_SIZE];
+#else
+    byte receiveBuffer[MQTT_MAX_TOPIC_LEN + MQTT_MAX_DATA_LEN + 2]; // Nothing is held so one message is enough
+#endif
+#if MQTT_QOS2 && MQTT_QOS2_EARLY_DELIVERY
+    word incomingIDs[MQTT_PACKET_QUEUE_SIZE]; // QoS 2 messages already delivered and waiting for PUBREL
+    byte incomingIDCount = 0; // Kept across connect() for as long as the broker keeps the session
+#endif
+#if MQTT_QOS2 && MQTT_RETRIES
+    PacketMessage  PUBRELQueue[MQTT_PACKET_QUEUE_SIZE];
+    byte PUBRELQueueCount;
+#endif
+    word nextPacketID = MQTT_MIN_PACKETID;
+    int  pingIntervalRemaining;
+    byte pingCount;
+#if MQTT_SUBMISSION_QUEUE_SIZE > 0
+    // One per priority, so high priority messages never wait behind normal ones
+    SubmissionQueue submissionQueues[prHIGH+1];
+    void processSubmissions();
+#endif
+    //
+    long reserveReceiveBuffer(word len);
+    void deliverMessage(char *topic, word topiclen, char *data, word datalen, bool retain, bool duplicate);
+    void deliverIncoming(char *topic, word topiclen, char *data, word datalen, bool retain, bool duplicate);
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+    LocalSubscription localSubscriptions[MQTT_LOCAL_SUBSCRIPTIONS] = {};
+    LocalEcho localEchoes[MQTT_LOCAL_ECHOES];  // Oldest first
+    byte localEchoCount = 0;
+    word echoHash(const char *topic, word topiclen, const char *data, word datalen);
+    bool takeLocalEcho(const char *topic, word topiclen, const char *data, word datalen, bool retain);
+    void expireLocalEchoes();
+    void removeLocalEcho(byte i);
+    void addLocalSubscription(word packetid, const char *filter);
+    void acceptLocalSubscription(word packetid);
+    void removeLocalSubscription(word packetid, const char *filter);
+    void deliverLocal(const PreparedTopic &topic, char *data);
+#endif
+#if MQTT_RATE_LIMITS > 0
+    RateLimit rateLimits[MQTT_RATE_LIMITS] = {};
+    RateLimit *findRateLimit(const char *topic, word topiclen, word hash);
+    void refillRateLimit(RateLimit *limit);
+    void processRateLimits();
+#endif
+#if MQTT_CACHE_ENTRIES > 0
+    CachedMessage cache[MQTT_CACHE_ENTRIES] = {};
+    unsigned long cacheClock = 0;
+    CachedMessage *findCached(const char *topic, word topiclen, word hash);
+    void updateCache(char *topic, word topiclen, char *data, word datalen);
+#endif
     //
     void reset();
     byte pingInterval();
     bool queueInterval();
-    bool addToOutgoingQueue(word packetid, byte qos, bool retain, bool duplicate, char* topic, char* data);
-    bool addToIncomingQueue(word packetid, byte qos, bool retain, bool duplicate, char* topic, char* data);
-    bool addToPUBRELQueue(word packetid);
+#if MQTT_RETRIES
+    // Round trip time estimate, in milliseconds
+    bool rttMeasured = false;
+    word srtt;
+    word rttvar;
+    word rto = MQTT_PACKET_TIMEOUT * 1000;  // Timeout for newly sent packets
+    bool queueExpired = false;  // A packet went unacknowledged, reported by intervalTimer()
+    void startRetry(RetryTimer *timer);
+    byte checkRetry(RetryTimer *timer);
+    void sampleRoundTrip(RetryTimer *timer);
+    bool outgoingQueueAvailable(byte priority);
+    bool addToOutgoingQueue(word packetid, byte qos, bool retain, bool duplicate, char* topic, char* data, byte priority);
     void deleteFromOutgoingQueue(byte i);
+    void acknowledgeOutgoing(byte i);
+#endif
+#if MQTT_QOS2 && !MQTT_QOS2_EARLY_DELIVERY
+    bool addToIncomingQueue(word packetid, bool retain, bool duplicate, word offset, word topiclen, word datalen);
+    bool resendPUBREC(word packetid);
     void deleteFromIncomingQueue(byte i); 
+#endif
+#if MQTT_QOS2 && MQTT_RETRIES
+    bool addToPUBRELQueue(word packetid);
     void deleteFromPUBRELQueue(byte i);
+#endif
     //
     byte recvCONNACK();
     byte recvPINGRESP();
@@ -134,39 +726,75 @@ class MQTTClient {
     byte recvUNSUBACK();
     byte recvPUBLISH(byte flags, long remainingLength);
     byte recvPUBACK();
+#if MQTT_QOS2
     byte recvPUBREC();
     byte recvPUBREL();
     byte recvPUBCOMP();  
+#endif
     //
     bool sendPINGREQ();
+    bool publishMessage(const PreparedTopic &topic, char *data, byte qos, bool retain, bool duplicate, byte priority);
+    bool sendPUBLISH(const PreparedTopic &topic, char *data, byte qos, bool retain, bool duplicate, word packetid);
     bool sendPUBACK(word packetid);
+#if MQTT_QOS2
     bool sendPUBREL(word packetid);
     bool sendPUBREC(word packetid);
     bool sendPUBCOMP(word packetid);
+#endif
   public:
-    Stream* stream;
+#if MQTT_SUBMISSION_QUEUE_SIZE > 0
+    MQTTClient();
+#endif
+#if MQTT_WILL_MESSAGE
     WillMessage willMessage;
+#endif
     bool isConnected;
+#if MQTT_RETRIES
+    LatencyStats ackStats[prHIGH+1]; // Time from first sending a QoS 1 or 2 message to its PUBACK or PUBREC, by priority
+    word retryTimeout() { return rto; }; // Milliseconds before a newly sent packet is resent
+#endif
+#if MQTT_SUBMISSION_QUEUE_SIZE > 0
+    LatencyStats submitStats[prHIGH+1]; // Time submitted messages wait to be published, by priority
+#endif
     // Events
     virtual void connected() {};
     virtual void initSession() {};
     virtual void subscribed(word packetID, byte resultCode) {};
     virtual void unsubscribed(word packetID) {};
     virtual void receiveMessage(char *topic, char *data, bool retain, bool duplicate) {};
+    // topic and data point into the receive buffer and are only valid until this returns
+    virtual void receiveData(char *topic, word topiclen, char *data, word datalen, bool retain, bool duplicate) { receiveMessage(topic,data,retain,duplicate); };
+#if MQTT_COMPRESSION
+    // Payload codec
+    bool compressPayloads = false;
+    virtual word encodePayload(char *data, word len, byte *buffer, word bufferLen);
+    virtual long decodePayload(byte *data, word len, char *buffer, word bufferLen);
+#endif
     // Methods
     bool connect(char *clientID, char *username, char *password, bool cleanSession = false, word keepAlive = MQTT_DEFAULT_KEEPALIVE);
     bool disconnect();
     void disconnected();
     bool subscribe(word packetid, char *filter, byte qos = qtAT_MOST_ONCE);
     bool unsubscribe(word packetid, char *filter);
-    bool publish(char *topic, char *data, byte qos = qtAT_MOST_ONCE, bool retain=false, bool duplicate=false);
+    bool publish(char *topic, char *data, byte qos = qtAT_MOST_ONCE, bool retain=false, bool duplicate=false, byte priority=prNORMAL);
+    bool publish(const PreparedTopic &topic, char *data, byte qos = qtAT_MOST_ONCE, bool retain=false, bool duplicate=false, byte priority=prNORMAL);
     byte dataAvailable(); // Needs to be called whenever there is data available
     byte intervalTimer(); // Needs to be called by program every second  
+    bool poll();          // Should be called from loop() to flush coalesced publishes and resend packets on time
+#if MQTT_RATE_LIMITS > 0
+    bool setRateLimit(const char *topic, word interval, byte burst = 1); // One publish per interval milliseconds, interval 0 removes the limit
+#endif
+#if MQTT_CACHE_ENTRIES > 0
+    const char *getCached(const char *topic, word *datalen = NULL); // Last value received on topic, or NULL
+#endif
+#if MQTT_SUBMISSION_QUEUE_SIZE > 0
+    bool submit(const char *topic, const char *data, byte qos = qtAT_MOST_ONCE, bool retain=false, byte priority=prNORMAL); // Safe to call from any thread
+#endif
 };
 
-bool MQTTClient::readByte(byte* b) {
+bool MQTTCodec::readByte(byte* b) {
   if (stream->available() == 0) {
-    delay(100);
+    clockDelay(100);
   }
   if (stream->available() > 0) {
     short s = stream->read();
@@ -181,16 +809,109 @@ bool MQTTClient::readByte(byte* b) {
   }
 }
 
-bool MQTTClient::writeByte(const byte b) {
+bool MQTTCodec::writeByte(const byte b) {
+#if MQTT_OUTPUT_BUFFER_SIZE > 0
+  if (outputLength == MQTT_OUTPUT_BUFFER_SIZE) {
+    flush();
+    if (outputLength == MQTT_OUTPUT_BUFFER_SIZE) {
+      // Drop the packet being encoded rather than ever send it half written
+      outputLength = outputCommitted;
+      return false;
+    }
+  }
+  if (outputLength == 0) {
+    outputStarted = clockMicros();
+  }
+  outputBuffer[outputLength++] = b;
+  return true;
+#else
   if (stream->write(b) == 0) {
     stream->flush();
     return (stream->write(b) == 1);
   } else {
     return true;
   }
+#endif
+}
+
+// Writes as much of the complete packets as the stream will accept without blocking.
+// Whatever is left is kept and resumed by poll(). Returns true once nothing is pending.
+bool MQTTCodec::flush() {
+#if MQTT_OUTPUT_BUFFER_SIZE > 0
+  word sent = 0;
+  size_t n;
+  
+  outputFlushing = true;
+  while (sent < outputCommitted) {
+    n = stream->write(outputBuffer + sent, outputCommitted - sent);
+    if (n == 0) {
+      break;
+    }
+    sent += n;
+  }
+  if (sent > 0) {
+    memmove(outputBuffer,outputBuffer + sent,outputLength - sent);
+    outputLength -= sent;
+    outputCommitted -= sent;
+  }
+  if (outputCommitted > 0) {
+    return false;
+  }
+  outputFlushing = false;
+#endif
+  return true;
+}
+
+word MQTTCodec::outputPending() {
+#if MQTT_OUTPUT_BUFFER_SIZE > 0
+  return outputCommitted;
+#else
+  return 0;
+#endif
+}
+
+bool MQTTCodec::poll() {
+#if MQTT_OUTPUT_BUFFER_SIZE > 0
+  if ((outputCommitted > 0) && (outputFlushing || (clockMicros() - outputStarted >= coalesceInterval))) {
+    return flush();
+  }
+#endif
+  return true;
+}
+
+bool MQTTClient::poll() {
+#if MQTT_SUBMISSION_QUEUE_SIZE > 0
+  processSubmissions();
+#endif
+#if MQTT_RATE_LIMITS > 0
+  processRateLimits();
+#endif
+#if MQTT_RETRIES
+  if (!queueInterval()) {
+    queueExpired = true;
+  }
+#endif
+  return MQTTCodec::poll();
+}
+
+// Called once a packet has been written. A complete packet is queued for output and
+// flushed straight away unless it may be coalesced with following ones. A failed
+// packet is removed from the queue.
+bool MQTTCodec::endPacket(bool result, bool coalesce) {
+#if MQTT_OUTPUT_BUFFER_SIZE > 0
+  if (!result) {
+    outputLength = outputCommitted;
+    return false;
+  }
+  outputCommitted = outputLength;
+  if (!coalesce || outputFlushing || (clockMicros() - outputStarted >= coalesceInterval)) {
+    flush();
+  }
+#endif
+  return result;
 }
     
-bool MQTTClient::readRemainingLength(long* value) {
+bool MQTTCodec::readRemainingLength(long* value) {
   long multiplier = 1;
   byte encodedByte;
 
@@ -212,7 +933,7 @@ bool MQTTClient::readRemainingLength(long* value) {
   return true;
 }
 
-bool MQTTClient::writeRemainingLength(const long value) {
+bool MQTTCodec::writeRemainingLength(const long value) {
   byte encodedByte;
   long lvalue;
 
@@ -230,7 +951,7 @@ bool MQTTClient::writeRemainingLength(const long value) {
   return true;
 }
 
-bool MQTTClient::readWord(word *value) {
+bool MQTTCodec::readWord(word *value) {
   byte b;
   if (readByte(&b)) {
     *value = b << 8;
@@ -245,7 +966,7 @@ bool MQTTClient::readWord(word *value) {
   }
 } 
 
-bool MQTTClient::writeWord(const word value) {
+bool MQTTCodec::writeWord(const word value) {
   byte b = value >> 8;
   if (writeByte(b)) {
     b = value & 0xFF;
@@ -259,7 +980,7 @@ bool MQTTClient::writeWord(const word value) {
   }
 }
 
-bool MQTTClient::readData(char* data, const word len) {
+bool MQTTCodec::readData(char* data, const word len) {
   byte* ptr;
   word remaining = len;
   ptr = (byte*)data;
@@ -276,10 +997,20 @@ bool MQTTClient::readData(char* data, const word len) {
   return true;  
 }
 
-bool MQTTClient::writeData(char* data, const word len) {
-  char *ptr;
+bool MQTTCodec::writeData(const char* data, const word len) {
+  const char *ptr;
   word rl = len;
   
+#if MQTT_OUTPUT_BUFFER_SIZE > 0
+  if (outputLength + len <= MQTT_OUTPUT_BUFFER_SIZE) {
+    if (outputLength == 0) {
+      outputStarted = clockMicros();
+    }
+    memcpy(outputBuffer + outputLength,data,len);
+    outputLength += len;
+    return true;
+  }
+#endif
   ptr = data;
   while (rl > 0) {  
     if (!writeByte(byte(*ptr))) {
@@ -291,14 +1022,15 @@ bool MQTTClient::writeData(char* data, const word len) {
   return true;
 }
 
-bool MQTTClient::readStr(char *str, const word len) {
+// str must have room for len + 1 bytes
+bool MQTTCodec::readStr(char *str, const word len) {
   word l;
   
   if (readWord(&l)) {
-    if (l < len) {
-      return readData(str,l);
+    if ((l <= len) && readData(str,l)) {
+      str[l] = 0;
+      return true;
     } else {
-      readData(str,len);
       return false;
     }  
   } else {
@@ -306,7 +1038,18 @@ bool MQTTClient::readStr(char *str, const word len) {
   }
 }
 
-bool MQTTClient::writeStr(char *str) {
+bool MQTTCodec::skipData(long len) {
+  byte b;
+  
+  while (len-- > 0) {
+    if (!readByte(&b)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MQTTCodec::writeStr(char *str) {
   char *ptr;
   word len;
   
@@ -326,13 +1069,56 @@ bool MQTTClient::writeStr(char *str) {
   }
 }
 
+// Finds len contiguous bytes in the receive buffer that are not held by a QoS 2 message
+// waiting for PUBREL. Messages are held in arrival order, so the free space runs from
+// the end of the newest one round to the start of the oldest one.
+long MQTTClient::reserveReceiveBuffer(word len) {
+  if (len > sizeof(receiveBuffer)) {
+    return -1;
+  }
+#if MQTT_QOS2 && !MQTT_QOS2_EARLY_DELIVERY
+  if (incomingPUBLISHQueueCount > 0) {
+    word tail = incomingPUBLISHQueue[0].offset;
+    if (receiveHead > tail) {
+      if (receiveHead + len <= sizeof(receiveBuffer)) {
+        return receiveHead;
+      } else if (len <= tail) {
+        return 0;
+      }
+    } else if ((receiveHead < tail) && (receiveHead + len <= tail)) {
+      return receiveHead;
+    }
+    return -1;
+  }
+  receiveHead = 0;
+#endif
+  return 0;
+}
+
 void MQTTClient::reset() {
   pingIntervalRemaining = 0;
   pingCount = 0;
-  incomingPUBLISHQueueCount = 0;
+#if MQTT_RETRIES
   outgoingPUBLISHQueueCount = 0;
+  memset(ackStats,0,sizeof(ackStats));
+  queueExpired = false;
+#endif
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+  localEchoCount = 0;
+#endif
+#if MQTT_QOS2 && !MQTT_QOS2_EARLY_DELIVERY
+  incomingPUBLISHQueueCount = 0;
+  receiveHead = 0;
+#endif
+#if MQTT_QOS2 && MQTT_RETRIES
   PUBRELQueueCount = 0;
+#endif
   isConnected = false;
+#if MQTT_OUTPUT_BUFFER_SIZE > 0
+  outputLength = 0;
+  outputCommitted = 0;
+  outputFlushing = false;
+#endif
 }
 
 bool MQTTClient::connect(char *clientID, char *username, char *password, bool cleanSession, word keepAlive)
@@ -356,6 +1142,7 @@ bool MQTTClient::connect(char *clientID, char *username, char *password, bool cl
     rl += strlen(password) + 2;
   }
 
+#if MQTT_WILL_MESSAGE
   if (willMessage.retain) {
     flags |= 32;
   }
@@ -364,6 +1151,7 @@ bool MQTTClient::connect(char *clientID, char *username, char *password, bool cl
     flags |= 4;
     rl += strlen(willMessage.topic) + 2 + strlen(willMessage.data) + 2;
   }  
+#endif
       
   if (cleanSession) {
     flags |= 2;
@@ -378,34 +1166,36 @@ bool MQTTClient::connect(char *clientID, char *username, char *password, bool cl
      (!writeByte('T')) ||
      (!writeByte('T')) ||
      (!writeByte(4))) 
-       { return false; }
+       { return endPacket(false); }
   
   if ((!writeByte(flags)) || 
      (!writeWord(keepAlive)) || 
      (!writeStr(clientID))) 
-       { return false; }
+       { return endPacket(false); }
 
+#if MQTT_WILL_MESSAGE
   if (willMessage.enabled) {
     if (!writeStr(willMessage.topic) || !writeStr(willMessage.data)) {
-      return false;
+      return endPacket(false);
     }
   }
+#endif
   
   if (username != NULL) {
     if (!writeStr(username)) {
-      return false;
+      return endPacket(false);
     }
   }
   
   if (password != NULL) {
     if (!writeStr(password)) {
-      return false;
+      return endPacket(false);
     }
   }
 
   pingIntervalRemaining = MQTT_DEFAULT_PING_INTERVAL;
    
-  return true;
+  return endPacket(true);
 }
 
 byte MQTTClient::recvCONNACK() {
@@ -452,6 +1242,14 @@ byte MQTTClient::recvCONNACK() {
     //Serial.println("Calling connected()");
     connected();
     if (!sessionPresent) {
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+      // The broker has forgotten our subscriptions
+      memset(localSubscriptions,0,sizeof(localSubscriptions));
+#endif
+#if MQTT_QOS2 && MQTT_QOS2_EARLY_DELIVERY
+      // Nor will it resend the PUBRELs we are waiting for
+      incomingIDCount = 0;
+#endif
       initSession();
     }
     return MQTT_ERROR_NONE;
@@ -468,7 +1266,7 @@ byte MQTTClient::recvCONNACK() {
 }
 
 bool MQTTClient::disconnect() {
-  if (writeByte(0xE0) && writeByte(0)) {
+  if (endPacket(writeByte(0xE0) && writeByte(0))) {
     isConnected = false;
     return true; 
   } else {
@@ -487,7 +1285,7 @@ bool MQTTClient::sendPINGREQ() {
   if (isConnected) {
     result = writeByte(12 << 4); 
     result &= writeByte(0);
-    return result;
+    return endPacket(result);
   } else {
     return false;
   }
@@ -521,167 +1319,272 @@ byte MQTTClient::pingInterval() {
   return MQTT_ERROR_NONE;
 }
 
-bool MQTTClient::addToOutgoingQueue(word packetid, byte qos, bool retain, bool duplicate, char* topic, char* data) {
+#if MQTT_RETRIES
+// Normal priority messages may not take the last MQTT_HIGH_PRIORITY_SLOTS entries
+bool MQTTClient::outgoingQueueAvailable(byte priority) {
+  byte count = 0;
+  
   if (outgoingPUBLISHQueueCount == MQTT_PACKET_QUEUE_SIZE) {
+    return false;
+  }
+  if (priority == prHIGH) {
+    return true;
+  }
+  for (byte i=0;i<outgoingPUBLISHQueueCount;i++) {
+    if (outgoingPUBLISHQueue[i].priority == prNORMAL) {
+      count++;
+    }
+  }
+  return (count < MQTT_PACKET_QUEUE_SIZE - MQTT_HIGH_PRIORITY_SLOTS);
+}
+
+bool MQTTClient::addToOutgoingQueue(word packetid, byte qos, bool retain, bool duplicate, char* topic, char* data, byte priority) {
+  if (!outgoingQueueAvailable(priority)) {
     //Serial.println("Error: outgoingPUBLISHQueue overflow");
     return false;
   }
   outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].packetid = packetid;
-  outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].timeout = MQTT_PACKET_TIMEOUT;
-  outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].retries = 0;
+  startRetry(&outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].retry);
   outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].qos = qos;
+  outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].priority = priority;
   outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].retain = retain;
   outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].duplicate = duplicate;
-  strlcpy(outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].topic,topic,MQTT_MAX_TOPIC_LEN);
-  strlcpy(outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].data,data,MQTT_MAX_DATA_LEN);
+  outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].firstSent = clockMillis();
+  strlcpy(outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].topic,topic,MQTT_MAX_TOPIC_LEN+1);
+  strlcpy(outgoingPUBLISHQueue[outgoingPUBLISHQueueCount].data,(data != NULL) ? data : "",MQTT_MAX_DATA_LEN+1);
   outgoingPUBLISHQueueCount++;
   return true;
 }
 
-bool MQTTClient::addToIncomingQueue(word packetid, byte qos, bool retain, bool duplicate, char* topic, char* data) {
+void MQTTClient::deleteFromOutgoingQueue(byte i) {
+  for (byte j=i;j<outgoingPUBLISHQueueCount - 1;j++) {
+    outgoingPUBLISHQueue[j] = outgoingPUBLISHQueue[j+1];
+  }
+  outgoingPUBLISHQueueCount--; 
+}
+
+// Records how long the message waited for its PUBACK or PUBREC and removes it
+void MQTTClient::acknowledgeOutgoing(byte i) {
+  mqttRecordLatency(&ackStats[outgoingPUBLISHQueue[i].priority],clockMillis() - outgoingPUBLISHQueue[i].firstSent);
+  sampleRoundTrip(&outgoingPUBLISHQueue[i].retry);
+  deleteFromOutgoingQueue(i);
+}
+
+#endif
+
+#if MQTT_QOS2 && !MQTT_QOS2_EARLY_DELIVERY
+bool MQTTClient::addToIncomingQueue(word packetid, bool retain, bool duplicate, word offset, word topiclen, word datalen) {
   if (incomingPUBLISHQueueCount == MQTT_PACKET_QUEUE_SIZE) {
     //Serial.println("Error: incomingPUBLISHQueue overflow");
     return false;
   }
   incomingPUBLISHQueue[incomingPUBLISHQueueCount].packetid = packetid;
-  incomingPUBLISHQueue[incomingPUBLISHQueueCount].timeout = MQTT_PACKET_TIMEOUT;
-  incomingPUBLISHQueue[incomingPUBLISHQueueCount].retries = 0;
-  incomingPUBLISHQueue[incomingPUBLISHQueueCount].qos = qos;
+  incomingPUBLISHQueue[incomingPUBLISHQueueCount].offset = offset;
+  incomingPUBLISHQueue[incomingPUBLISHQueueCount].topiclen = topiclen;
+  incomingPUBLISHQueue[incomingPUBLISHQueueCount].datalen = datalen;
+#if MQTT_RETRIES
+  startRetry(&incomingPUBLISHQueue[incomingPUBLISHQueueCount].retry);
+#endif
   incomingPUBLISHQueue[incomingPUBLISHQueueCount].retain = retain;
   incomingPUBLISHQueue[incomingPUBLISHQueueCount].duplicate = duplicate;
-  strlcpy(incomingPUBLISHQueue[incomingPUBLISHQueueCount].topic,topic,MQTT_MAX_TOPIC_LEN);
-  strlcpy(incomingPUBLISHQueue[incomingPUBLISHQueueCount].data,data,MQTT_MAX_DATA_LEN);
   incomingPUBLISHQueueCount++;
+  receiveHead = offset + topiclen + datalen + 2;
   return true;
 }
 
-bool MQTTClient::addToPUBRELQueue(word packetid) {
-  if (PUBRELQueueCount == MQTT_PACKET_QUEUE_SIZE) {
-    //Serial.println("Error: PUBRELQueue overflow");
-    return false;
+// A redelivered PUBLISH that is still waiting for its PUBREL only needs its PUBREC resent.
+// Returns false if the packet id is not held.
+bool MQTTClient::resendPUBREC(word packetid) {
+  for (byte i=0;i<incomingPUBLISHQueueCount;i++) {
+    if (incomingPUBLISHQueue[i].packetid == packetid) {
+#if MQTT_RETRIES
+      startRetry(&incomingPUBLISHQueue[i].retry);
+#endif
+      sendPUBREC(packetid);
+      return true;
+    }
   }
-  PUBRELQueue[PUBRELQueueCount].packetid = packetid;
-  PUBRELQueue[PUBRELQueueCount].timeout = MQTT_PACKET_TIMEOUT;
-  PUBRELQueue[PUBRELQueueCount].retries = 0;
-  PUBRELQueueCount++;
-  return true;
-}
-
-void MQTTClient::deleteFromOutgoingQueue(byte i) {
-  for (byte j=i;j<outgoingPUBLISHQueueCount - 1;j++) {
-    outgoingPUBLISHQueue[j].packetid = outgoingPUBLISHQueue[j+1].packetid;
-    outgoingPUBLISHQueue[j].timeout = outgoingPUBLISHQueue[j+1].timeout;
-    outgoingPUBLISHQueue[j].retries = outgoingPUBLISHQueue[j+1].retries;
-    outgoingPUBLISHQueue[j].qos = outgoingPUBLISHQueue[j+1].qos;
-    outgoingPUBLISHQueue[j].retain = outgoingPUBLISHQueue[j+1].retain;
-    outgoingPUBLISHQueue[j].duplicate = outgoingPUBLISHQueue[j+1].duplicate;
-    strlcpy(outgoingPUBLISHQueue[j].topic,outgoingPUBLISHQueue[j+1].topic,MQTT_MAX_TOPIC_LEN);
-    strlcpy(outgoingPUBLISHQueue[j].data,outgoingPUBLISHQueue[j+1].topic,MQTT_MAX_DATA_LEN);            
-  }
-  outgoingPUBLISHQueueCount--; 
+  return false;
 }
 
 void MQTTClient::deleteFromIncomingQueue(byte i) {
   for (byte j=i;j<incomingPUBLISHQueueCount - 1;j++) {
-    incomingPUBLISHQueue[j].packetid = incomingPUBLISHQueue[j+1].packetid;
-    incomingPUBLISHQueue[j].timeout = incomingPUBLISHQueue[j+1].timeout;
-    incomingPUBLISHQueue[j].retries = incomingPUBLISHQueue[j+1].retries;
-    incomingPUBLISHQueue[j].qos = incomingPUBLISHQueue[j+1].qos;
-    incomingPUBLISHQueue[j].retain = incomingPUBLISHQueue[j+1].retain;
-    incomingPUBLISHQueue[j].duplicate = incomingPUBLISHQueue[j+1].duplicate;
-    strlcpy(incomingPUBLISHQueue[j].topic,incomingPUBLISHQueue[j+1].topic,MQTT_MAX_TOPIC_LEN);
-    strlcpy(incomingPUBLISHQueue[j].data,incomingPUBLISHQueue[j+1].topic,MQTT_MAX_DATA_LEN);            
+    incomingPUBLISHQueue[j] = incomingPUBLISHQueue[j+1];
   }
   incomingPUBLISHQueueCount--; 
 }
 
+#endif
+
+#if MQTT_QOS2 && MQTT_RETRIES
+bool MQTTClient::addToPUBRELQueue(word packetid) {
+  if (PUBRELQueueCount == MQTT_PACKET_QUEUE_SIZE) {
+    //Serial.println("Error: PUBRELQueue overflow");
+    return false;
+  }
+  PUBRELQueue[PUBRELQueueCount].packetid = packetid;
+  startRetry(&PUBRELQueue[PUBRELQueueCount].retry);
+  PUBRELQueueCount++;
+  return true;
+}
+
 void MQTTClient::deleteFromPUBRELQueue(byte i) {
   for (byte j=i;j<PUBRELQueueCount - 1;j++) {
-    PUBRELQueue[j].packetid = PUBRELQueue[j+1].packetid;
-    PUBRELQueue[j].timeout = PUBRELQueue[j+1].timeout;
-    PUBRELQueue[j].retries = PUBRELQueue[j+1].retries;         
+    PUBRELQueue[j] = PUBRELQueue[j+1];
   }
   PUBRELQueueCount--; 
 }
+#endif
+
+#if MQTT_RETRIES
+void MQTTClient::startRetry(RetryTimer *timer) {
+  timer->sent = clockMillis();
+  timer->timeout = (rto < MQTT_RETRY_LIMIT) ? rto : MQTT_RETRY_LIMIT;
+  timer->waited = 0;
+  timer->retries = 0;
+}
+
+// Returns rtRESEND and backs the timer off when the packet is due to be resent, or
+// rtEXPIRED once it has gone unacknowledged for MQTT_RETRY_LIMIT milliseconds
+byte MQTTClient::checkRetry(RetryTimer *timer) {
+  word now = clockMillis();
+  unsigned long timeout;
+  
+  if (word(now - timer->sent) < timer->timeout) {
+    return rtWAIT;
+  }
+  timer->waited += timer->timeout;
+  if (timer->waited >= MQTT_RETRY_LIMIT) {
+    return rtEXPIRED;
+  }
+  timer->retries++;
+  timer->sent = now;
+  // The last wait is cut short so the packet expires on time
+  timeout = (timer->timeout > MQTT_MAX_RETRY_TIMEOUT / 2) ? MQTT_MAX_RETRY_TIMEOUT : timer->timeout * 2;
+  if (timeout > MQTT_RETRY_LIMIT - timer->waited) {
+    timeout = MQTT_RETRY_LIMIT - timer->waited;
+  }
+  timer->timeout = timeout;
+  return rtRESEND;
+}
+
+// Updates the retry timeout from an acknowledgement, as in RFC 6298. Packets that were
+// resent are skipped since it is unknown which copy was acknowledged.
+void MQTTClient::sampleRoundTrip(RetryTimer *timer) {
+  unsigned long rtt;
+  unsigned long timeout;
+  
+  if (timer->retries > 0) {
+    return;
+  }
+  rtt = word(word(clockMillis()) - timer->sent);
+  if (rttMeasured) {
+    rttvar = (3UL * rttvar + ((srtt > rtt) ? srtt - rtt : rtt - srtt)) / 4;
+    srtt = (7UL * srtt + rtt) / 8;
+  } else {
+    srtt = rtt;
+    rttvar = rtt / 2;
+    rttMeasured = true;
+  }
+  timeout = srtt + 4UL * rttvar;
+  if (timeout < MQTT_MIN_RETRY_TIMEOUT) {
+    timeout = MQTT_MIN_RETRY_TIMEOUT;
+  } else if (timeout > MQTT_MAX_RETRY_TIMEOUT) {
+    timeout = MQTT_MAX_RETRY_TIMEOUT;
+  }
+  rto = timeout;
+}
+#endif
 
 bool MQTTClient::queueInterval() {
-  int i;
   bool result = true;
   
-  // Outgoing PUBLISH
-  if (outgoingPUBLISHQueueCount > 0) {
+#if MQTT_RETRIES
+  // Outgoing PUBLISH, high priority messages are resent first
+  for (int priority=prHIGH;priority>=prNORMAL;priority--) {
     //Serial.println("Outgoingqueuecount");
-    for (i=outgoingPUBLISHQueueCount-1;i>=0;i--) {
+    for (int i=outgoingPUBLISHQueueCount-1;i>=0;i--) {
       //Serial.println(i);
-      if (--outgoingPUBLISHQueue[i].timeout == 0) {
-        outgoingPUBLISHQueue[i].retries++;
-        if (outgoingPUBLISHQueue[i].retries >= MQTT_PACKET_RETRIES) {
-          deleteFromOutgoingQueue(i);
-          result = false;
-        } else {
-          //Serial.println('publish');
-          publish(outgoingPUBLISHQueue[i].topic,outgoingPUBLISHQueue[i].data,outgoingPUBLISHQueue[i].qos,outgoingPUBLISHQueue[i].retain,true);
-          outgoingPUBLISHQueue[i].timeout = MQTT_PACKET_TIMEOUT;
-        }
+      if (outgoingPUBLISHQueue[i].priority != priority) {
+        continue;
+      }
+      switch (checkRetry(&outgoingPUBLISHQueue[i].retry)) {
+        case rtEXPIRED : deleteFromOutgoingQueue(i);
+                         result = false;
+                         break;
+        case rtRESEND  : //Serial.println('publish');
+                         sendPUBLISH(PreparedTopic(outgoingPUBLISHQueue[i].topic,strlen(outgoingPUBLISHQueue[i].topic)),outgoingPUBLISHQueue[i].data,outgoingPUBLISHQueue[i].qos,outgoingPUBLISHQueue[i].retain,true,outgoingPUBLISHQueue[i].packetid);
+                         break;
       } 
     }
   }
   
+#endif
+
+#if MQTT_QOS2 && MQTT_RETRIES && !MQTT_QOS2_EARLY_DELIVERY
   // Incoming PUBLISH
   if (incomingPUBLISHQueueCount > 0) {
     //Serial.println("Incomingqueuecount");
-    for (i=incomingPUBLISHQueueCount-1;i>=0;i--) {
-      if (--incomingPUBLISHQueue[i].timeout == 0) {
-        incomingPUBLISHQueue[i].retries++;
-        if (incomingPUBLISHQueue[i].retries >= MQTT_PACKET_RETRIES) {
-          deleteFromIncomingQueue(i);
-          result = false;
-        } else {
-          sendPUBREC(incomingPUBLISHQueue[i].packetid);
-          incomingPUBLISHQueue[i].timeout = MQTT_PACKET_TIMEOUT;
-        }
+    for (int i=incomingPUBLISHQueueCount-1;i>=0;i--) {
+      switch (checkRetry(&incomingPUBLISHQueue[i].retry)) {
+        case rtEXPIRED : deleteFromIncomingQueue(i);
+                         result = false;
+                         break;
+        case rtRESEND  : sendPUBREC(incomingPUBLISHQueue[i].packetid);
+                         break;
       } 
     }
   }
+#endif
 
+#if MQTT_QOS2 && MQTT_RETRIES
   // PUBRELQueue
   if (PUBRELQueueCount > 0) {
     //Serial.println("PUBRELQueueCount");
-    for (i=PUBRELQueueCount-1;i>=0;i--) {
-      if (--PUBRELQueue[i].timeout == 0) {
-        PUBRELQueue[i].retries++;
-        if (PUBRELQueue[i].retries >= MQTT_PACKET_RETRIES) {
-          deleteFromPUBRELQueue(i);
-          result = false;
-        } else {
-          sendPUBREL(PUBRELQueue[i].packetid);
-          PUBRELQueue[i].timeout = MQTT_PACKET_TIMEOUT;
-        }
+    for (int i=PUBRELQueueCount-1;i>=0;i--) {
+      switch (checkRetry(&PUBRELQueue[i].retry)) {
+        case rtEXPIRED : deleteFromPUBRELQueue(i);
+                         result = false;
+                         break;
+        case rtRESEND  : sendPUBREL(PUBRELQueue[i].packetid);
+                         break;
       } 
     }
   }
+#endif
   
   return result;
 }
 
 byte MQTTClient::intervalTimer() {
-  if (!queueInterval()) {
+  poll();
+#if MQTT_RETRIES
+  if (queueExpired) {
+    queueExpired = false;
     return MQTT_ERROR_PACKET_QUEUE_TIMEOUT;
-  } else {
-    return pingInterval();
   }
+#endif
+  return pingInterval();
 }
 
 bool MQTTClient::subscribe(word packetid, char *filter, byte qos) {
   bool result;
 
-  if (filter != NULL) {
+  if ((filter != NULL) && mqttValidFilter(filter)) {
     result = writeByte(0x82);
     result &= writeRemainingLength(2 + 2 + 1 + strlen(filter));
     result &= writeWord(packetid);
     result &= writeStr(filter);
-    result &= writeByte(qos);
-    return result;
+    result &= writeByte(qos > MQTT_MAX_QOS ? MQTT_MAX_QOS : qos);
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+    if (endPacket(result)) {
+      addLocalSubscription(packetid,filter);
+      return true;
+    }
+    return false;
+#else
+    return endPacket(result);
+#endif
   } else {
     return false; 
   }
@@ -706,6 +1609,13 @@ byte MQTTClient::recvSUBACK(long remainingLength) {
     while (rl-- > 0) {
       if (readByte(&rc)) {
         //Serial.print("subscribed "); Serial.print(packetid); Serial.print(" "); Serial.println(rc);
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+        if (rc == 0x80) {
+          removeLocalSubscription(packetid,NULL);
+        } else {
+          acceptLocalSubscription(packetid);
+        }
+#endif
         subscribed(packetid,rc);
       } else {
         return MQTT_ERROR_PAYLOAD_INVALID;
@@ -720,12 +1630,15 @@ byte MQTTClient::recvSUBACK(long remainingLength) {
 bool MQTTClient::unsubscribe(word packetid, char *filter) {
   bool result;
   
-  if (filter != NULL) {
+  if ((filter != NULL) && mqttValidFilter(filter)) {
     result = writeByte(0xA2);
     result &= writeRemainingLength(2+2+strlen(filter));
     result &= writeWord(packetid);
     result &= writeStr(filter);
-    return result;
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+    removeLocalSubscription(packetid,filter);
+#endif
+    return endPacket(result);
   } else {
     return false;
   }
@@ -744,75 +1657,515 @@ byte MQTTClient::recvUNSUBACK() {
   }
 }
 
-bool MQTTClient::publish(char *topic, char *data, byte qos, bool retain, bool duplicate) {
-  byte flags = 0;
+#if MQTT_COMPRESSION
+word MQTTClient::encodePayload(char *data, word len, byte *buffer, word bufferLen) {
+  word packedlen = mqttCompress((byte*)data,len,buffer,bufferLen);
+  // A raw payload that starts with the marker must always be sent compressed, even if
+  // that makes it larger. sendPUBLISH() refuses it when it does not fit at all.
+  if ((packedlen < len) || (byte(data[0]) == MQTT_COMPRESSION_MARKER)) {
+    return packedlen;
+  } else {
+    return 0;
+  }
+}
+
+long MQTTClient::decodePayload(byte *data, word len, char *buffer, word bufferLen) {
+  return mqttDecompress(data,len,(byte*)buffer,bufferLen);
+}
+#endif
+
+bool MQTTClient::publish(char *topic, char *data, byte qos, bool retain, bool duplicate, byte priority) {
+  word topiclen;
+
+  if (topic != NULL) {
+    topiclen = strlen(topic);
+    if ((topiclen > MQTT_MAX_TOPIC_LEN) || !mqttValidTopic(topic,topiclen)) {
+      return false;
+    }
+    return publish(PreparedTopic(topic,topiclen),data,qos,retain,duplicate,priority);
+  } else return false;
+}
+
+bool MQTTClient::publish(const PreparedTopic &topic, char *data, byte qos, bool retain, bool duplicate, byte priority) {
+  if ((topic.length>0) && (topic.length<=MQTT_MAX_TOPIC_LEN) && (qos<=MQTT_MAX_QOS) && (priority<=prHIGH) && (isConnected)) {
+#if MQTT_RATE_LIMITS > 0
+    RateLimit *limit = findRateLimit(topic.topic,topic.length,mqttHash(topic.topic,topic.length));
+    if (limit != NULL) {
+      refillRateLimit(limit);
+      if (limit->tokens == 0) {
+        limit->pending = true;
+        limit->qos = qos;
+        limit->priority = priority;
+        limit->retain = retain;
+        strlcpy(limit->data,(data != NULL) ? data : "",MQTT_MAX_DATA_LEN+1);
+        return true;
+      }
+      limit->tokens--;
+      limit->pending = false;
+    }
+#endif
+    return publishMessage(topic,data,qos,retain,duplicate,priority);
+  } else return false;
+}
+
+bool MQTTClient::publishMessage(const PreparedTopic &topic, char *data, byte qos, bool retain, bool duplicate, byte priority) {
   word packetid;
+  bool result;
+  
+#if MQTT_RETRIES
+  // Don't send what could not be resent
+  if ((qos > 0) && !outgoingQueueAvailable(priority)) {
+    return false;
+  }
+#endif
+
+  packetid = nextPacketID++;
+  if (nextPacketID >= MQTT_MAX_PACKETID) {
+    nextPacketID = MQTT_MIN_PACKETID;
+  }
+
+  result = sendPUBLISH(topic,data,qos,retain,duplicate,packetid);
+  
+#if MQTT_RETRIES
+  if (result && (qos > 0)) {
+    result = addToOutgoingQueue(packetid,qos,retain,duplicate,(char*)topic.topic,data,priority);
+  }
+#endif
+
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+  // Last, since receiveMessage() may publish again and take the queue slot
+  if (result) {
+    deliverLocal(topic,data);
+  }
+#endif
+          
+  return result;
+}
+
+#if MQTT_RATE_LIMITS > 0
+RateLimit *MQTTClient::findRateLimit(const char *topic, word topiclen, word hash) {
+  for (byte i=0;i<MQTT_RATE_LIMITS;i++) {
+    if ((rateLimits[i].interval > 0) && (rateLimits[i].hash == hash) && (strncmp(rateLimits[i].topic,topic,topiclen) == 0) && (rateLimits[i].topic[topiclen] == 0)) {
+      return &rateLimits[i];
+    }
+  }
+  return NULL;
+}
+
+bool MQTTClient::setRateLimit(const char *topic, word interval, byte burst) {
+  word topiclen;
+  word hash;
+  RateLimit *limit;
+  
+  if ((topic == NULL) || (burst == 0)) {
+    return false;
+  }
+  topiclen = strlen(topic);
+  if ((topiclen == 0) || (topiclen > MQTT_MAX_TOPIC_LEN)) {
+    return false;
+  }
+  hash = mqttHash(topic,topiclen);
+  limit = findRateLimit(topic,topiclen,hash);
+  if (limit == NULL) {
+    if (interval == 0) {
+      return true;
+    }
+    for (byte i=0;i<MQTT_RATE_LIMITS;i++) {
+      if (rateLimits[i].interval == 0) {
+        limit = &rateLimits[i];
+        limit->hash = hash;
+        limit->pending = false;
+        strlcpy(limit->topic,topic,MQTT_MAX_TOPIC_LEN+1);
+        break;
+      }
+    }
+    if (limit == NULL) {
+      return false;
+    }
+  }
+  limit->interval = interval;
+  limit->burst = burst;
+  limit->tokens = burst;
+  limit->refilled = clockMillis();
+  return true;
+}
+
+void MQTTClient::refillRateLimit(RateLimit *limit) {
+  unsigned long now = clockMillis();
+  
+  while ((limit->tokens < limit->burst) && (now - limit->refilled >= limit->interval)) {
+    limit->tokens++;
+    limit->refilled += limit->interval;
+  }
+  if (limit->tokens == limit->burst) {
+    limit->refilled = now;
+  }
+}
+
+// Sends held values whose topic has earned a token
+void MQTTClient::processRateLimits() {
+  for (byte i=0;i<MQTT_RATE_LIMITS;i++) {
+    RateLimit *limit = &rateLimits[i];
+    if ((limit->interval > 0) && limit->pending) {
+      refillRateLimit(limit);
+      if ((limit->tokens > 0) && publishMessage(PreparedTopic(limit->topic,strlen(limit->topic)),limit->data,limit->qos,limit->retain,false,limit->priority)) {
+        limit->tokens--;
+        limit->pending = false;
+      }
+    }
+  }
+}
+#endif
+
+bool MQTTClient::sendPUBLISH(const PreparedTopic &topic, char *data, byte qos, bool retain, bool duplicate, word packetid) {
+  byte flags = 0;
   long remainingLength;
   bool result;
+  word datalen = 0;
+  char *payload = data;
+#if MQTT_COMPRESSION
+  byte packed[MQTT_MAX_DATA_LEN];
+#endif
 
+  if (!isConnected) {
+    return false;
+  }
+  
+  //Serial.print("sendPUBLISH topic="); Serial.print(topic.topic); Serial.print(" data="); Serial.print(data); Serial.print(" qos="); Serial.println(qos);
+  flags |= (qos << 1);
+  if (duplicate) {
+    flags |= 8;
+  } 
+  if (retain) {
+    flags |= 1;
+  }
   
-  if ((topic != NULL) && (strlen(topic)>0) && (qos<3) && (isConnected)) {
+  if (data != NULL) {
+    datalen = strlen(data);
+  }
+#if MQTT_COMPRESSION
+  if (compressPayloads && (datalen > 0)) {
+    word packedlen = encodePayload(data,datalen,packed,MQTT_MAX_DATA_LEN);
+    if (packedlen > 0) {
+      payload = (char*)packed;
+      datalen = packedlen;
+    } else if (byte(data[0]) == MQTT_COMPRESSION_MARKER) {
+      // Sent raw it would be mistaken for a compressed payload
+      return false;
+    }
+  }
+#endif
+
+  remainingLength = 2 + topic.length + datalen; 
+  if (qos>0) {
+    remainingLength += 2;
+  }
+
+  result = (
+    writeByte(0x30 | flags) &&
+    writeRemainingLength(remainingLength) &&
+    writeData((const char*)topic.header,2) &&
+    writeData(topic.topic,topic.length)
+  );    
+
+  if (result && (qos > 0)) {
+    result = writeWord(packetid);
+  }
+
+  if (result && (datalen > 0)) {
+    result = writeData(payload,datalen);
+  }
+
+  return endPacket(result, qos == 0);
+}
 
-    //Serial.print("sendPUBLISH topic="); Serial.print(topic); Serial.print(" data="); Serial.print(data); Serial.print(" qos="); Serial.println(qos);
-    flags |= (qos << 1);
-    if (duplicate) {
-      flags |= 8;
-    } 
-    if (retain) {
-      flags |= 1;
+#if MQTT_SUBMISSION_QUEUE_SIZE > 0
+MQTTClient::MQTTClient() {
+  for (byte priority=prNORMAL;priority<=prHIGH;priority++) {
+    for (size_t i=0;i<MQTT_SUBMISSION_QUEUE_SIZE;i++) {
+      submissionQueues[priority].cells[i].sequence.store(i,std::memory_order_relaxed);
     }
-    
-    remainingLength = 2 + strlen(topic) + strlen(data); 
-    if (qos>0) {
-      remainingLength += 2;
+    submissionQueues[priority].head.store(0,std::memory_order_relaxed);
+    submissionQueues[priority].tail = 0;
+  }
+  memset(submitStats,0,sizeof(submitStats));
+}
+
+bool MQTTClient::submit(const char *topic, const char *data, byte qos, bool retain, byte priority) {
+  SubmissionQueue *queue;
+  SubmittedMessage *cell;
+  size_t pos;
+  word topiclen;
+  
+  if ((topic == NULL) || (qos > MQTT_MAX_QOS) || (priority > prHIGH)) {
+    return false;
+  }
+  // Checked here so that a message that can never be published does not hold up the
+  // queue, and is not cut short by the copy into it
+  topiclen = strlen(topic);
+  if ((topiclen > MQTT_MAX_TOPIC_LEN) || !mqttValidTopic(topic,topiclen)) {
+    return false;
+  }
+  if ((data != NULL) && (strlen(data) > MQTT_MAX_DATA_LEN)) {
+    return false;
+  }
+  queue = &submissionQueues[priority];
+  pos = queue->head.load(std::memory_order_relaxed);
+  for (;;) {
+    cell = &queue->cells[pos & (MQTT_SUBMISSION_QUEUE_SIZE - 1)];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    long diff = (long)seq - (long)pos;
+    if (diff == 0) {
+      if (queue->head.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // Full
+    } else {
+      pos = queue->head.load(std::memory_order_relaxed);
     }
-    
-    packetid = nextPacketID++;
-    if (nextPacketID >= MQTT_MAX_PACKETID) {
-      nextPacketID = MQTT_MIN_PACKETID;
+  }
+  cell->submitted = clockMillis();
+  cell->qos = qos;
+  cell->retain = retain;
+  strlcpy(cell->topic,topic,MQTT_MAX_TOPIC_LEN+1);
+  strlcpy(cell->data,(data != NULL) ? data : "",MQTT_MAX_DATA_LEN+1);
+  cell->sequence.store(pos + 1,std::memory_order_release);
+  return true;
+}
+
+// Publishes everything submitted by other threads, high priority messages first. Must
+// only be called from the thread that owns the stream. Each queue stops at the first
+// message there is no room for yet and leaves it queued.
+void MQTTClient::processSubmissions() {
+  SubmissionQueue *queue;
+  SubmittedMessage *cell;
+  
+  for (int priority=prHIGH;priority>=prNORMAL;priority--) {
+    queue = &submissionQueues[priority];
+    while (isConnected) {
+      cell = &queue->cells[queue->tail & (MQTT_SUBMISSION_QUEUE_SIZE - 1)];
+      if (cell->sequence.load(std::memory_order_acquire) != queue->tail + 1) {
+        break;
+      }
+#if MQTT_RETRIES
+      if ((cell->qos > 0) && !outgoingQueueAvailable(priority)) {
+        break; // Wait for acknowledgements to free a slot
+      }
+#endif
+      if (publish(cell->topic,cell->data,cell->qos,cell->retain,false,priority)) {
+        mqttRecordLatency(&submitStats[priority],clockMillis() - cell->submitted);
+      } else if (isConnected && (outputPending() > 0)) {
+        return; // Output buffer full, try again once it has drained
+      }
+      cell->sequence.store(queue->tail + MQTT_SUBMISSION_QUEUE_SIZE,std::memory_order_release);
+      queue->tail++;
+    }
+  }
+}
+#endif
+
+void MQTTClient::deliverMessage(char *topic, word topiclen, char *data, word datalen, bool retain, bool duplicate) {
+#if MQTT_CACHE_ENTRIES > 0
+  updateCache(topic,topiclen,data,datalen);
+#endif
+  receiveData(topic,topiclen,data,datalen,retain,duplicate);
+}
+
+// Messages from the broker. The broker's copy of a message that was already delivered
+// locally is dropped.
+void MQTTClient::deliverIncoming(char *topic, word topiclen, char *data, word datalen, bool retain, bool duplicate) {
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+  if (takeLocalEcho(topic,topiclen,data,datalen,retain)) {
+    return;
+  }
+#endif
+  deliverMessage(topic,topiclen,data,datalen,retain,duplicate);
+}
+
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+word MQTTClient::echoHash(const char *topic, word topiclen, const char *data, word datalen) {
+  return mqttHash(topic,topiclen) * 31 + mqttHash(data,datalen);
+}
+
+// True if the message is the broker's copy of one already delivered locally. The echo is
+// forgotten so only one copy is dropped.
+bool MQTTClient::takeLocalEcho(const char *topic, word topiclen, const char *data, word datalen, bool retain) {
+  word hash;
+  
+  if (retain) {
+    return false;
+  }
+  hash = echoHash(topic,topiclen,data,datalen);
+  expireLocalEchoes();
+  for (byte i=0;i<localEchoCount;i++) {
+    if (localEchoes[i].hash == hash) {
+      removeLocalEcho(i);
+      return true;
     }
+  }
+  return false;
+}
 
-    result = (
-      writeByte(0x30 | flags) &&
-      writeRemainingLength(remainingLength) &&
-      writeStr(topic)
-    );    
+// Forgets echoes the broker should have sent back by now, so they cannot swallow a later
+// message from another client with the same topic and payload. The broker's copy takes
+// at least a round trip and may be resent, so they are kept for as long as the broker
+// could keep trying before the connection is considered dead.
+void MQTTClient::expireLocalEchoes() {
+  word now = clockMillis();
+  
+  while ((localEchoCount > 0) && (word(now - localEchoes[0].sent) >= MQTT_RETRY_LIMIT)) {
+    removeLocalEcho(0);
+  }
+}
+
+void MQTTClient::removeLocalEcho(byte i) {
+  localEchoCount--;
+  memmove(localEchoes + i,localEchoes + i + 1,sizeof(LocalEcho) * (localEchoCount - i));
+}
 
-    if (result && (qos > 0)) {
-      result = writeWord(packetid);
+void MQTTClient::addLocalSubscription(word packetid, const char *filter) {
+  LocalSubscription *unused = NULL;
+  
+  for (byte i=0;i<MQTT_LOCAL_SUBSCRIPTIONS;i++) {
+    if (strcmp(localSubscriptions[i].filter,filter) == 0) {
+      localSubscriptions[i].packetid = packetid;
+      return;
     }
+    if ((unused == NULL) && (localSubscriptions[i].filter[0] == 0)) {
+      unused = &localSubscriptions[i];
+    }
+  }
+  // When the table is full the subscription is only served by the broker
+  if (unused != NULL) {
+    unused->packetid = packetid;
+    unused->subacked = false;
+    strlcpy(unused->filter,filter,MQTT_MAX_TOPIC_LEN+1);
+  }
+}
 
-    if (result && (data != NULL)) {
-      result = writeData(data,strlen(data));
+void MQTTClient::acceptLocalSubscription(word packetid) {
+  for (byte i=0;i<MQTT_LOCAL_SUBSCRIPTIONS;i++) {
+    if ((localSubscriptions[i].filter[0] != 0) && (localSubscriptions[i].packetid == packetid)) {
+      localSubscriptions[i].subacked = true;
     }
-    
-    if (result && (qos > 0)) {
-      addToOutgoingQueue(packetid,qos,retain,duplicate,topic,data);
+  }
+}
+
+// Removes the entry for filter, or for packetid if filter is NULL
+void MQTTClient::removeLocalSubscription(word packetid, const char *filter) {
+  for (byte i=0;i<MQTT_LOCAL_SUBSCRIPTIONS;i++) {
+    if ((localSubscriptions[i].filter[0] != 0) && 
+        ((filter != NULL) ? (strcmp(localSubscriptions[i].filter,filter) == 0) : (localSubscriptions[i].packetid == packetid))) {
+      localSubscriptions[i].filter[0] = 0;
     }
-            
-    return result;
-       
-  } else return false;
+  }
+}
+
+// Delivers a message that was just published to our own matching subscriptions and
+// remembers it so the copy the broker sends back is dropped
+void MQTTClient::deliverLocal(const PreparedTopic &topic, char *data) {
+  char localTopic[MQTT_MAX_TOPIC_LEN+1];
+  char localData[MQTT_MAX_DATA_LEN+1];
+  word datalen = 0;
+  byte i;
+  
+  for (i=0;i<MQTT_LOCAL_SUBSCRIPTIONS;i++) {
+    if ((localSubscriptions[i].filter[0] != 0) && localSubscriptions[i].subacked &&
+        mqttTopicMatches(localSubscriptions[i].filter,strlen(localSubscriptions[i].filter),topic.topic,topic.length)) {
+      break;
+    }
+  }
+  if ((i == MQTT_LOCAL_SUBSCRIPTIONS) || (topic.length > MQTT_MAX_TOPIC_LEN)) {
+    return;
+  }
+  if (data != NULL) {
+    datalen = strlen(data);
+  }
+  if (datalen > MQTT_MAX_DATA_LEN) {
+    return;
+  }
+  expireLocalEchoes();
+  if (localEchoCount == MQTT_LOCAL_ECHOES) {
+    removeLocalEcho(0);
+  }
+  localEchoes[localEchoCount].hash = echoHash(topic.topic,topic.length,data,datalen);
+  localEchoes[localEchoCount].sent = clockMillis();
+  localEchoCount++;
+  // Copied so the receiver gets writable strings, as it does for messages from the broker
+  memcpy(localTopic,topic.topic,topic.length);
+  localTopic[topic.length] = 0;
+  memcpy(localData,(data != NULL) ? data : "",datalen);
+  localData[datalen] = 0;
+  deliverMessage(localTopic,topic.length,localData,datalen,false,false);
+}
+#endif
+
+#if MQTT_CACHE_ENTRIES > 0
+CachedMessage *MQTTClient::findCached(const char *topic, word topiclen, word hash) {
+  for (byte i=0;i<MQTT_CACHE_ENTRIES;i++) {
+    if ((cache[i].lastUsed > 0) && (cache[i].hash == hash) && (strncmp(cache[i].topic,topic,topiclen) == 0) && (cache[i].topic[topiclen] == 0)) {
+      return &cache[i];
+    }
+  }
+  return NULL;
 }
 
+// Stores the value in the topic's entry, or in the least recently used one
+void MQTTClient::updateCache(char *topic, word topiclen, char *data, word datalen) {
+  word hash = mqttHash(topic,topiclen);
+  CachedMessage *entry = findCached(topic,topiclen,hash);
+  
+  if (entry == NULL) {
+    entry = &cache[0];
+    for (byte i=1;i<MQTT_CACHE_ENTRIES;i++) {
+      if (cache[i].lastUsed < entry->lastUsed) {
+        entry = &cache[i];
+      }
+    }
+    entry->hash = hash;
+    memcpy(entry->topic,topic,topiclen);
+    entry->topic[topiclen] = 0;
+  }
+  memcpy(entry->data,data,datalen);
+  entry->data[datalen] = 0;
+  entry->datalen = datalen;
+  entry->lastUsed = ++cacheClock;
+}
+
+const char *MQTTClient::getCached(const char *topic, word *datalen) {
+  word topiclen;
+  CachedMessage *entry;
+  
+  if (topic == NULL) {
+    return NULL;
+  }
+  topiclen = strlen(topic);
+  entry = findCached(topic,topiclen,mqttHash(topic,topiclen));
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->lastUsed = ++cacheClock;
+  if (datalen != NULL) {
+    *datalen = entry->datalen;
+  }
+  return entry->data;
+}
+#endif
+
 byte MQTTClient::recvPUBLISH(byte flags, long remainingLength) {
-  char topic[MQTT_MAX_TOPIC_LEN+1];
-  char data[MQTT_MAX_DATA_LEN+1];
+  char *topic;
+  char *data;
+  word topiclen;
+  word datalen;
+  word reserved;
+  long offset;
   byte qos;
   bool retain;
   bool duplicate;
   word packetid=0;
   long rl;
-  byte i;
 
-  for (i=0;i<MQTT_MAX_TOPIC_LEN+1;i++) {
-    topic[i] = 0;
-  }
-
-  for (i=0;i<MQTT_MAX_DATA_LEN+1;i++) {
-    data[i] = 0;
-  }
-  
   duplicate = (flags & 8) > 0;
   retain = (flags & 1) > 0;
   qos = (flags & 6) >> 1;
@@ -831,51 +2184,136 @@ byte MQTTClient::recvPUBLISH(byte flags, long remainingLength) {
     return MQTT_ERROR_NOT_CONNECTED;
   }
   
-  if (!readStr(topic,MQTT_MAX_TOPIC_LEN)) {
+  if (!readWord(&topiclen)) {
+    return MQTT_ERROR_VARHEADER_INVALID; 
+  }
+  // Messages too long to receive are skipped so the next packet starts in the right place
+  if (topiclen > MQTT_MAX_TOPIC_LEN) {
+    skipData(remainingLength - 2);
     return MQTT_ERROR_VARHEADER_INVALID; 
   }
 
-  rl = remainingLength - strlen(topic) - 2;
-  //Serial.print("readtopic rl="); Serial.println(rl);
-  //Serial.print("topic="); Serial.println(topic);
-  
+  rl = remainingLength - topiclen - 2;
   if (qos>0) {
-    if (readWord(&packetid)) {
-      //Serial.print("packetid="); Serial.println(packetid);
-      rl -= 2;
-    } else {
-      return MQTT_ERROR_VARHEADER_INVALID;
-    }     
+    rl -= 2;
   }
-
   //Serial.print("readmessage rl="); Serial.println(rl);
   if (rl > MQTT_MAX_DATA_LEN) {
     //Serial.println("Payload1");
+    skipData(remainingLength - 2);
     return MQTT_ERROR_PAYLOAD_INVALID;
   }
-
-
-  //Serial.print("rl="); Serial.println(rl);
-  word datalen;
   if (rl < 0)  {
     datalen = 0;
   } else {
     datalen = rl;
   }
+
+  // The topic and data are read straight into the receive buffer and delivered from there
+  reserved = datalen;
+#if MQTT_COMPRESSION
+  if (compressPayloads) {
+    reserved = MQTT_MAX_DATA_LEN;
+  }
+#endif
+  reserved += topiclen + 2;
+#if MQTT_QOS2 && !MQTT_QOS2_EARLY_DELIVERY
+  if (qos == 2) {
+    // A held message must leave room after it for a full size one, so that QoS 0 and 1
+    // messages are still received while the buffer holds QoS 2 messages
+    reserved += MQTT_MAX_TOPIC_LEN + MQTT_MAX_DATA_LEN + 2;
+  }
+#endif
+  offset = reserveReceiveBuffer(reserved);
+  if (offset < 0) {
+    // No room while held QoS 2 messages fill the buffer. The rest of the packet is still
+    // read so the next one starts in the right place.
+    rl = remainingLength - 2;
+#if MQTT_QOS2 && !MQTT_QOS2_EARLY_DELIVERY
+    if (qos == 2) {
+      if (!skipData(topiclen) || !readWord(&packetid)) {
+        return MQTT_ERROR_VARHEADER_INVALID;
+      }
+      rl -= topiclen + 2;
+    }
+#endif
+    if (!skipData(rl)) {
+      return MQTT_ERROR_PAYLOAD_INVALID;
+    }
+#if MQTT_QOS2 && !MQTT_QOS2_EARLY_DELIVERY
+    if ((qos == 2) && resendPUBREC(packetid)) {
+      return MQTT_ERROR_NONE;
+    }
+#endif
+    return MQTT_ERROR_PACKET_QUEUE_FULL;
+  }
+  topic = (char*)receiveBuffer + offset;
+  data = topic + topiclen + 1;
+  
+  if (!readData(topic,topiclen)) {
+    return MQTT_ERROR_VARHEADER_INVALID; 
+  }
+  topic[topiclen] = 0;
+  //Serial.print("topic="); Serial.println(topic);
+  
+  if (qos>0) {
+    if (!readWord(&packetid)) {
+      return MQTT_ERROR_VARHEADER_INVALID;
+    }     
+    //Serial.print("packetid="); Serial.println(packetid);
+  }
      
   if (readData(data,datalen)) {
+    data[datalen] = 0;
     //Serial.print("data="); Serial.println(data);
+#if MQTT_COMPRESSION
+    char inflated[MQTT_MAX_DATA_LEN+1];
+    if (compressPayloads && (datalen > 0) && (byte(data[0]) == MQTT_COMPRESSION_MARKER)) {
+      // Payloads that fail to decode are delivered as received
+      long inflatedlen = decodePayload((byte*)data,datalen,inflated,MQTT_MAX_DATA_LEN);
+      if (inflatedlen >= 0) {
+        datalen = inflatedlen;
+        memcpy(data,inflated,datalen);
+        data[datalen] = 0;
+      }
+    }
+#endif
     if (qos<2) {
-      receiveMessage(topic,data,retain,duplicate);  
+      deliverIncoming(topic,topiclen,data,datalen,retain,duplicate);  
       if (qos==1) {
         sendPUBACK(packetid);
       }
     } else {
-      if (addToIncomingQueue(packetid,qos,retain,duplicate,topic,data)) {
+#if MQTT_QOS2 && MQTT_QOS2_EARLY_DELIVERY
+      // Delivered on arrival. A redelivered PUBLISH that is still waiting for its PUBREL
+      // was already delivered and only needs its PUBREC resent. The ids are never
+      // expired, so once the list is full further QoS 2 messages are refused.
+      byte i;
+      for (i=0;(i<incomingIDCount) && (incomingIDs[i] != packetid);i++);
+      if (i == incomingIDCount) {
+        if (incomingIDCount == MQTT_PACKET_QUEUE_SIZE) {
+          return MQTT_ERROR_PACKET_QUEUE_FULL;
+        }
+        incomingIDs[incomingIDCount++] = packetid;
+        deliverIncoming(topic,topiclen,data,datalen,retain,duplicate);
+      }
+      sendPUBREC(packetid);
+#elif MQTT_QOS2
+      if (resendPUBREC(packetid)) {
+        return MQTT_ERROR_NONE;
+      }
+      if (addToIncomingQueue(packetid,retain,duplicate,offset,topiclen,datalen)) {
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+        // Matched now, the PUBREL may come long after the echo would have expired
+        incomingPUBLISHQueue[incomingPUBLISHQueueCount-1].echo = takeLocalEcho(topic,topiclen,data,datalen,retain);
+#endif
         sendPUBREC(packetid);
       } else {  
         return MQTT_ERROR_PACKET_QUEUE_FULL;
       }
+#else
+      return MQTT_ERROR_NOT_IMPLEMENTED;
+#endif
     }
     return MQTT_ERROR_NONE;
   } else {
@@ -889,13 +2327,17 @@ byte MQTTClient::recvPUBACK() {
   
   if (readWord(&packetid)) { 
     //Serial.print("recvPUBACK("); Serial.print(packetid); Serial.println(")");
+#if MQTT_RETRIES
     for (byte i=0;i<outgoingPUBLISHQueueCount;i++) {
       if (outgoingPUBLISHQueue[i].packetid == packetid) {
-        deleteFromOutgoingQueue(i);
+        acknowledgeOutgoing(i);
         return MQTT_ERROR_NONE;
       }
     }
     return MQTT_ERROR_PACKETID_NOT_FOUND;
+#else
+    return MQTT_ERROR_NONE;
+#endif
   } else {  
    return MQTT_ERROR_PAYLOAD_INVALID;
   }
@@ -908,21 +2350,24 @@ bool MQTTClient::sendPUBACK(word packetid) {
     result = writeByte(0x40); 
     result &= writeByte(0x02);
     result &= writeWord(packetid);
-    return result;
+    return endPacket(result);
   } else {
     return false;
   }
 }
 
+#if MQTT_QOS2
 byte MQTTClient::recvPUBREC() {
   word packetid;
   
   if (readWord(&packetid)) { 
     //Serial.print("recvPUBREC("); Serial.print(packetid); Serial.println(")");
+#if MQTT_RETRIES
     for (byte i=0;i<outgoingPUBLISHQueueCount;i++) {
       if (outgoingPUBLISHQueue[i].packetid == packetid) {
-        deleteFromOutgoingQueue(i);
+        acknowledgeOutgoing(i);
         if (sendPUBREL(packetid)) {
+          addToPUBRELQueue(packetid);
           return MQTT_ERROR_NONE;
         } else {
           return MQTT_ERROR_SEND_PUBREL_FAILED;
@@ -930,6 +2375,13 @@ byte MQTTClient::recvPUBREC() {
       }
     }
     return MQTT_ERROR_PACKETID_NOT_FOUND;
+#else
+    if (sendPUBREL(packetid)) {
+      return MQTT_ERROR_NONE;
+    } else {
+      return MQTT_ERROR_SEND_PUBREL_FAILED;
+    }
+#endif
   } else {  
    return MQTT_ERROR_PAYLOAD_INVALID;
   }
@@ -942,7 +2394,7 @@ bool MQTTClient::sendPUBREC(word packetid) {
     result = writeByte(0x50); 
     result &= writeByte(0x02);
     result &= writeWord(packetid);
-    return result;
+    return endPacket(result);
   } else {
     return false;
   }
@@ -953,9 +2405,32 @@ byte MQTTClient::recvPUBREL() {
   
   if (readWord(&packetid)) { 
     //Serial.print("recvPUBREL("); Serial.print(packetid); Serial.println(")");
+#if MQTT_QOS2_EARLY_DELIVERY
+    // The message was delivered when it arrived. A PUBREL resent after a lost PUBCOMP
+    // finds nothing left and is answered all the same.
+    for (byte i=0;i<incomingIDCount;i++) {
+      if (incomingIDs[i] == packetid) {
+        incomingIDs[i] = incomingIDs[--incomingIDCount];
+        break;
+      }
+    }
+    if (sendPUBCOMP(packetid)) {
+      return MQTT_ERROR_NONE;
+    } else {
+      return MQTT_ERROR_SEND_PUBCOMP_FAILED;
+    }
+#else
     for (byte i=0;i<incomingPUBLISHQueueCount;i++) {
       if (incomingPUBLISHQueue[i].packetid == packetid) {
-        receiveMessage(incomingPUBLISHQueue[i].topic,incomingPUBLISHQueue[i].data,incomingPUBLISHQueue[i].retain,incomingPUBLISHQueue[i].duplicate);
+        char *topic = (char*)receiveBuffer + incomingPUBLISHQueue[i].offset;
+        char *data = topic + incomingPUBLISHQueue[i].topiclen + 1;
+        bool echo = false;
+#if MQTT_LOCAL_SUBSCRIPTIONS > 0
+        echo = incomingPUBLISHQueue[i].echo;
+#endif
+        if (!echo) {
+          deliverMessage(topic,incomingPUBLISHQueue[i].topiclen,data,incomingPUBLISHQueue[i].datalen,incomingPUBLISHQueue[i].retain,incomingPUBLISHQueue[i].duplicate);
+        }
         deleteFromIncomingQueue(i);
         if (sendPUBCOMP(packetid)) {
           return MQTT_ERROR_NONE;
@@ -965,6 +2440,7 @@ byte MQTTClient::recvPUBREL() {
       }
     }
     return MQTT_ERROR_PACKETID_NOT_FOUND;
+#endif
   } else {  
    return MQTT_ERROR_PAYLOAD_INVALID;
   }
@@ -977,10 +2453,7 @@ bool MQTTClient::sendPUBREL(word packetid) {
     result = writeByte(0x62); 
     result &= writeByte(0x02);
     result &= writeWord(packetid);
-    if (result) {
-      addToPUBRELQueue(packetid);   
-    }
-    return result;
+    return endPacket(result);
   } else {
     return false;
   }
@@ -991,13 +2464,18 @@ byte MQTTClient::recvPUBCOMP() {
   
   if (readWord(&packetid)) { 
     //Serial.print("recvPUBCOMP("); Serial.print(packetid); Serial.println(")");
+#if MQTT_RETRIES
     for (byte i=0;i<PUBRELQueueCount;i++) {
       if (PUBRELQueue[i].packetid == packetid) {
+        sampleRoundTrip(&PUBRELQueue[i].retry);
         deleteFromPUBRELQueue(i);
         return MQTT_ERROR_NONE;
       }
     }
     return MQTT_ERROR_PACKETID_NOT_FOUND;
+#else
+    return MQTT_ERROR_NONE;
+#endif
   } else {  
    return MQTT_ERROR_PAYLOAD_INVALID;
   }
@@ -1010,11 +2488,12 @@ bool MQTTClient::sendPUBCOMP(word packetid) {
     result = writeByte(0x70); 
     result &= writeByte(0x02);
     result &= writeWord(packetid);
-    return result;
+    return endPacket(result);
   } else {
     return false;
   }
 }
+#endif
 
 byte MQTTClient::dataAvailable() {
   byte b;
@@ -1044,11 +2523,15 @@ byte MQTTClient::dataAvailable() {
     case ptPUBLISH   : return recvPUBLISH(flags,remainingLength); break;
     case ptPINGRESP  : return recvPINGRESP(); break;
     case ptPUBACK    : return recvPUBACK(); break;
+#if MQTT_QOS2
     case ptPUBREC    : return recvPUBREC(); break;
     case ptPUBREL    : return recvPUBREL(); break;
     case ptPUBCOMP   : return recvPUBCOMP(); break;
+#endif
     default: return MQTT_ERROR_UNHANDLED_PACKETTYPE;
   }
 
   return MQTT_ERROR_NONE;
 }
+
+#endif
@@ -0,0 +1,573 @@
+#ifndef MQTTBROKER_H
+#define MQTTBROKER_H
+
+#include "mqtt.h"
+
+#define MQTT_BROKER_CONNECTIONS                   4 // Number of clients that can be connected at the same time
+#define MQTT_BROKER_SUBSCRIPTIONS                16 // Number of subscriptions shared by all connections
+#define MQTT_BROKER_RETAINED                      8 // Number of topics that can hold a retained message
+#define MQTT_BROKER_CLIENTID_LEN                 23 // Bytes
+#define MQTT_BROKER_CONNECT_TIMEOUT              10 // Number of seconds a new connection has to send CONNECT
+
+struct BrokerSubscription {
+  byte connection;  // MQTT_BROKER_CONNECTIONS when the entry is free
+  byte qos;
+  word levelHash;   // mqttHash of the first level of the filter, 0 when it is a wildcard
+  char filter[MQTT_MAX_TOPIC_LEN+1];
+};
+
+struct RetainedMessage {
+  bool used;
+  byte qos;
+  word datalen;
+  char topic[MQTT_MAX_TOPIC_LEN+1];
+  char data[MQTT_MAX_DATA_LEN+1];
+};
+
+// One client connected to the broker
+class MQTTBrokerConnection: public MQTTCodec {
+  friend class MQTTBroker;
+  private:
+    word nextPacketID = MQTT_MIN_PACKETID;
+    word keepAlive;
+    word idleSeconds;
+    bool sendPUBLISH(const char *topic, word topiclen, const char *data, word datalen, byte qos, bool retain);
+  public:
+    bool isConnected;
+    char clientID[MQTT_BROKER_CLIENTID_LEN+1];
+};
+
+// A small broker for a hub with a few local clients. Supports clean sessions with QoS 0
+// and 1 and retained messages, all in fixed memory. QoS 1 messages routed to a client
+// are not resent, QoS 2 publishes close the connection.
+class MQTTBroker {
+  private:
+    BrokerSubscription subscriptions[MQTT_BROKER_SUBSCRIPTIONS];
+    RetainedMessage retained[MQTT_BROKER_RETAINED] = {};
+    //
+    word levelHash(const char *topic);
+    void closeConnection(byte i);
+    bool addSubscription(byte i, const char *filter, byte qos, byte *slot);
+    void removeSubscription(byte i, const char *filter);
+    void storeRetained(const char *topic, word topiclen, const char *data, word datalen, byte qos);
+    void sendRetained(byte i, byte slot);
+    void route(const char *topic, word topiclen, const char *data, word datalen, byte qos);
+    //
+    byte recvCONNECT(byte i);
+    byte recvPUBLISH(byte i, byte flags, long remainingLength);
+    byte recvSUBSCRIBE(byte i, long remainingLength);
+    byte recvUNSUBSCRIBE(byte i, long remainingLength);
+  public:
+    MQTTBroker();
+    MQTTBrokerConnection connections[MQTT_BROKER_CONNECTIONS];
+    // Events
+    virtual void clientConnected(byte i) {};
+    virtual void clientDisconnected(byte i) {}; // The broker has dropped the connection, close its socket
+    virtual void published(byte i, char *topic, char *data, bool retain) {}; // Connection i published a message
+    // Methods
+    int  accept(Stream *stream);       // Returns the connection number for a new client, or -1 if all are in use
+    void disconnected(byte i);         // Call when the client's socket has closed
+    byte dataAvailable(byte i);        // Needs to be called whenever connection i has data available
+    byte intervalTimer();              // Needs to be called by program every second
+    void poll();                       // Should be called from loop() to flush coalesced publishes on time
+    bool publish(const char *topic, const char *data, byte qos = qtAT_MOST_ONCE, bool retain = false); // Publish from the hub itself
+};
+
+bool MQTTBrokerConnection::sendPUBLISH(const char *topic, word topiclen, const char *data, word datalen, byte qos, bool retain) {
+  byte flags = 0;
+  long remainingLength;
+  bool result;
+
+  //Serial.print("broker sendPUBLISH topic="); Serial.print(topic); Serial.print(" qos="); Serial.println(qos);
+  flags |= (qos << 1);
+  if (retain) {
+    flags |= 1;
+  }
+
+  remainingLength = 2 + topiclen + datalen;
+  if (qos > 0) {
+    remainingLength += 2;
+  }
+
+  result = (
+    writeByte(0x30 | flags) &&
+    writeRemainingLength(remainingLength) &&
+    writeWord(topiclen) &&
+    writeData(topic,topiclen)
+  );
+
+  if (result && (qos > 0)) {
+    result = writeWord(nextPacketID);
+    if (nextPacketID == MQTT_MAX_PACKETID) {
+      nextPacketID = MQTT_MIN_PACKETID;
+    } else {
+      nextPacketID++;
+    }
+  }
+
+  if (result && (datalen > 0)) {
+    result = writeData(data,datalen);
+  }
+
+  return endPacket(result, qos == 0);
+}
+
+MQTTBroker::MQTTBroker() {
+  for (byte i=0;i<MQTT_BROKER_SUBSCRIPTIONS;i++) {
+    subscriptions[i].connection = MQTT_BROKER_CONNECTIONS;
+  }
+  for (byte i=0;i<MQTT_BROKER_CONNECTIONS;i++) {
+    connections[i].stream = NULL;
+    connections[i].isConnected = false;
+  }
+}
+
+word MQTTBroker::levelHash(const char *topic) {
+  if ((*topic == '+') || (*topic == '#')) {
+    return 0;
+  }
+  return mqttHash(topic,mqttLevelEnd(topic,0,strlen(topic)));
+}
+
+int MQTTBroker::accept(Stream *stream) {
+  for (byte i=0;i<MQTT_BROKER_CONNECTIONS;i++) {
+    if (connections[i].stream == NULL) {
+      connections[i].stream = stream;
+      connections[i].isConnected = false;
+      connections[i].clientID[0] = 0;
+      connections[i].keepAlive = MQTT_BROKER_CONNECT_TIMEOUT;
+      connections[i].idleSeconds = 0;
+      return i;
+    }
+  }
+  return -1;
+}
+
+void MQTTBroker::disconnected(byte i) {
+  //Serial.print("broker disconnected "); Serial.println(i);
+  for (byte j=0;j<MQTT_BROKER_SUBSCRIPTIONS;j++) {
+    if (subscriptions[j].connection == i) {
+      subscriptions[j].connection = MQTT_BROKER_CONNECTIONS;
+    }
+  }
+  connections[i].isConnected = false;
+  connections[i].stream = NULL;
+}
+
+void MQTTBroker::closeConnection(byte i) {
+  if (connections[i].stream != NULL) {
+    connections[i].flush();
+    disconnected(i);
+    clientDisconnected(i);
+  }
+}
+
+bool MQTTBroker::addSubscription(byte i, const char *filter, byte qos, byte *slot) {
+  byte unused = MQTT_BROKER_SUBSCRIPTIONS;
+
+  for (byte j=0;j<MQTT_BROKER_SUBSCRIPTIONS;j++) {
+    if (subscriptions[j].connection == i) {
+      // A second subscription to the same filter replaces the first
+      if (strcmp(subscriptions[j].filter,filter) == 0) {
+        subscriptions[j].qos = qos;
+        *slot = j;
+        return true;
+      }
+    } else if ((subscriptions[j].connection == MQTT_BROKER_CONNECTIONS) && (unused == MQTT_BROKER_SUBSCRIPTIONS)) {
+      unused = j;
+    }
+  }
+  if (unused == MQTT_BROKER_SUBSCRIPTIONS) {
+    return false;
+  }
+  subscriptions[unused].connection = i;
+  subscriptions[unused].qos = qos;
+  subscriptions[unused].levelHash = levelHash(filter);
+  strcpy(subscriptions[unused].filter,filter);
+  *slot = unused;
+  return true;
+}
+
+void MQTTBroker::removeSubscription(byte i, const char *filter) {
+  for (byte j=0;j<MQTT_BROKER_SUBSCRIPTIONS;j++) {
+    if ((subscriptions[j].connection == i) && (strcmp(subscriptions[j].filter,filter) == 0)) {
+      subscriptions[j].connection = MQTT_BROKER_CONNECTIONS;
+      return;
+    }
+  }
+}
+
+// An empty payload clears the retained message
+void MQTTBroker::storeRetained(const char *topic, word topiclen, const char *data, word datalen, byte qos) {
+  byte unused = MQTT_BROKER_RETAINED;
+
+  for (byte j=0;j<MQTT_BROKER_RETAINED;j++) {
+    if (retained[j].used) {
+      if (strcmp(retained[j].topic,topic) == 0) {
+        unused = j;
+        break;
+      }
+    } else if (unused == MQTT_BROKER_RETAINED) {
+      unused = j;
+    }
+  }
+  if (unused == MQTT_BROKER_RETAINED) {
+    return;
+  }
+  if (datalen == 0) {
+    retained[unused].used = false;
+    return;
+  }
+  retained[unused].used = true;
+  retained[unused].qos = qos;
+  retained[unused].datalen = datalen;
+  memcpy(retained[unused].topic,topic,topiclen);
+  retained[unused].topic[topiclen] = 0;
+  memcpy(retained[unused].data,data,datalen);
+  retained[unused].data[datalen] = 0;
+}
+
+void MQTTBroker::sendRetained(byte i, byte slot) {
+  BrokerSubscription *sub = &subscriptions[slot];
+
+  for (byte j=0;j<MQTT_BROKER_RETAINED;j++) {
+    if (retained[j].used && mqttTopicMatches(sub->filter,retained[j].topic)) {
+      connections[i].sendPUBLISH(retained[j].topic,strlen(retained[j].topic),retained[j].data,retained[j].datalen,
+        retained[j].qos < sub->qos ? retained[j].qos : sub->qos,true);
+    }
+  }
+}
+
+// Sends the message once to every connection with a matching subscription, at the
+// highest QoS any of them granted
+void MQTTBroker::route(const char *topic, word topiclen, const char *data, word datalen, byte qos) {
+  byte granted[MQTT_BROKER_CONNECTIONS];
+  word hash = levelHash(topic);
+
+  memset(granted,0xFF,sizeof(granted));
+  for (byte j=0;j<MQTT_BROKER_SUBSCRIPTIONS;j++) {
+    BrokerSubscription *sub = &subscriptions[j];
+    if ((sub->connection == MQTT_BROKER_CONNECTIONS) || ((sub->levelHash != 0) && (sub->levelHash != hash))) {
+      continue;
+    }
+    if (((granted[sub->connection] == 0xFF) || (granted[sub->connection] < sub->qos)) && mqttTopicMatches(sub->filter,strlen(sub->filter),topic,topiclen)) {
+      granted[sub->connection] = sub->qos;
+    }
+  }
+  for (byte i=0;i<MQTT_BROKER_CONNECTIONS;i++) {
+    if (granted[i] != 0xFF) {
+      connections[i].sendPUBLISH(topic,topiclen,data,datalen,qos < granted[i] ? qos : granted[i],false);
+    }
+  }
+}
+
+bool MQTTBroker::publish(const char *topic, const char *data, byte qos, bool retain) {
+  word topiclen;
+  word datalen = 0;
+
+  if ((topic == NULL) || (qos > qtAT_LEAST_ONCE)) {
+    return false;
+  }
+  topiclen = strlen(topic);
+  if (data != NULL) {
+    datalen = strlen(data);
+  }
+  if ((topiclen > MQTT_MAX_TOPIC_LEN) || (datalen > MQTT_MAX_DATA_LEN) || !mqttValidTopic(topic,topiclen)) {
+    return false;
+  }
+  if (retain) {
+    storeRetained(topic,topiclen,data,datalen,qos);
+  }
+  route(topic,topiclen,data,datalen,qos);
+  return true;
+}
+
+byte MQTTBroker::recvCONNECT(byte i) {
+  MQTTBrokerConnection *conn = &connections[i];
+  char protocol[5];
+  byte level;
+  byte flags;
+  word len;
+  byte returnCode = MQTT_CONNACK_SUCCESS;
+
+  if (conn->isConnected) {
+    return MQTT_ERROR_ALREADY_CONNECTED;
+  }
+
+  if (!conn->readStr(protocol,4) || (strcmp(protocol,"MQTT") != 0) ||
+      !conn->readByte(&level) || !conn->readByte(&flags) || !conn->readWord(&conn->keepAlive)) {
+    return MQTT_ERROR_VARHEADER_INVALID;
+  }
+  if ((flags & 1) > 0) {
+    return MQTT_ERROR_INVALID_PACKET_FLAGS;
+  }
+
+  if (!conn->readWord(&len)) {
+    return MQTT_ERROR_PAYLOAD_INVALID;
+  }
+  if (len > MQTT_BROKER_CLIENTID_LEN) {
+    if (!conn->skipData(len)) {
+      return MQTT_ERROR_PAYLOAD_INVALID;
+    }
+    returnCode = MQTT_CONNACK_CLIENTID_REJECTED;
+  } else {
+    if (!conn->readData(conn->clientID,len)) {
+      return MQTT_ERROR_PAYLOAD_INVALID;
+    }
+    conn->clientID[len] = 0;
+    if ((len == 0) && ((flags & 2) == 0)) {
+      returnCode = MQTT_CONNACK_CLIENTID_REJECTED;
+    }
+  }
+
+  // The will message, username and password are read and ignored
+  if ((flags & 4) > 0) {
+    if (!conn->readWord(&len) || !conn->skipData(len) || !conn->readWord(&len) || !conn->skipData(len)) {
+      return MQTT_ERROR_WILLMESSAGE_INVALID;
+    }
+  }
+  if ((flags & 128) > 0) {
+    if (!conn->readWord(&len) || !conn->skipData(len)) {
+      return MQTT_ERROR_PAYLOAD_INVALID;
+    }
+  }
+  if ((flags & 64) > 0) {
+    if (!conn->readWord(&len) || !conn->skipData(len)) {
+      return MQTT_ERROR_PAYLOAD_INVALID;
+    }
+  }
+
+  if (level != 4) {
+    returnCode = MQTT_CONNACK_UNACCEPTABLE_PROTOCOL;
+  }
+
+  // Sessions are never kept so session present is always 0
+  if (!conn->endPacket(conn->writeByte(0x20) && conn->writeByte(0x02) && conn->writeByte(0) && conn->writeByte(returnCode))) {
+    return MQTT_ERROR_UNKNOWN;
+  }
+
+  switch (returnCode) {
+    case MQTT_CONNACK_SUCCESS               : break;
+    case MQTT_CONNACK_UNACCEPTABLE_PROTOCOL : return MQTT_ERROR_UNACCEPTABLE_PROTOCOL;
+    default                                 : return MQTT_ERROR_CLIENTID_REJECTED;
+  }
+  //Serial.print("broker clientConnected "); Serial.println(conn->clientID);
+  conn->isConnected = true;
+  clientConnected(i);
+  return MQTT_ERROR_NONE;
+}
+
+byte MQTTBroker::recvPUBLISH(byte i, byte flags, long remainingLength) {
+  MQTTBrokerConnection *conn = &connections[i];
+  char topic[MQTT_MAX_TOPIC_LEN+1];
+  char data[MQTT_MAX_DATA_LEN+1];
+  word topiclen;
+  word datalen;
+  word packetid = 0;
+  byte qos;
+  long rl;
+
+  qos = (flags & 6) >> 1;
+  if (qos > qtAT_LEAST_ONCE) {
+    return MQTT_ERROR_NOT_IMPLEMENTED;
+  }
+
+  if (!conn->readWord(&topiclen) || (topiclen == 0) || (topiclen > MQTT_MAX_TOPIC_LEN) || !conn->readData(topic,topiclen)) {
+    return MQTT_ERROR_VARHEADER_INVALID;
+  }
+  topic[topiclen] = 0;
+  if (!mqttValidTopic(topic,topiclen)) {
+    return MQTT_ERROR_VARHEADER_INVALID;
+  }
+
+  if (qos > 0) {
+    if (!conn->readWord(&packetid)) {
+      return MQTT_ERROR_VARHEADER_INVALID;
+    }
+  }
+
+  rl = remainingLength - topiclen - 2;
+  if (qos > 0) {
+    rl -= 2;
+  }
+  if ((rl < 0) || (rl > MQTT_MAX_DATA_LEN)) {
+    return MQTT_ERROR_PAYLOAD_INVALID;
+  }
+  datalen = rl;
+  if (!conn->readData(data,datalen)) {
+    return MQTT_ERROR_PAYLOAD_INVALID;
+  }
+  data[datalen] = 0;
+
+  if (qos == 1) {
+    if (!conn->endPacket(conn->writeByte(0x40) && conn->writeByte(0x02) && conn->writeWord(packetid))) {
+      return MQTT_ERROR_UNKNOWN;
+    }
+  }
+
+  if ((flags & 1) > 0) {
+    storeRetained(topic,topiclen,data,datalen,qos);
+  }
+  published(i,topic,data,(flags & 1) > 0);
+  route(topic,topiclen,data,datalen,qos);
+  return MQTT_ERROR_NONE;
+}
+
+byte MQTTBroker::recvSUBSCRIBE(byte i, long remainingLength) {
+  MQTTBrokerConnection *conn = &connections[i];
+  char filter[MQTT_MAX_TOPIC_LEN+1];
+  byte codes[MQTT_BROKER_SUBSCRIPTIONS];
+  byte slots[MQTT_BROKER_SUBSCRIPTIONS];
+  byte count = 0;
+  word packetid;
+  word len;
+  byte qos;
+  long rl;
+  bool result;
+
+  if (!conn->readWord(&packetid)) {
+    return MQTT_ERROR_VARHEADER_INVALID;
+  }
+  rl = remainingLength - 2;
+  if (rl <= 0) {
+    return MQTT_ERROR_NO_SUBSCRIPTION_LIST;
+  }
+
+  while (rl > 0) {
+    if (count == MQTT_BROKER_SUBSCRIPTIONS) {
+      return MQTT_ERROR_INVALID_SUBSCRIPTION_ENTRIES;
+    }
+    if (!conn->readWord(&len) || (len > MQTT_MAX_TOPIC_LEN) || !conn->readData(filter,len) || !conn->readByte(&qos)) {
+      return MQTT_ERROR_INVALID_SUBSCRIPTION_ENTRIES;
+    }
+    filter[len] = 0;
+    rl -= len + 3;
+    if (qos > qtEXACTLY_ONCE) {
+      return MQTT_ERROR_INVALID_SUBSCRIPTION_ENTRIES;
+    }
+    if (qos > qtAT_LEAST_ONCE) {
+      qos = qtAT_LEAST_ONCE;
+    }
+    if (mqttValidFilter(filter,len) && addSubscription(i,filter,qos,&slots[count])) {
+      codes[count] = qos;
+    } else {
+      codes[count] = 0x80;
+    }
+    count++;
+  }
+
+  result = conn->writeByte(0x90);
+  result &= conn->writeRemainingLength(2 + count);
+  result &= conn->writeWord(packetid);
+  for (byte j=0;j<count;j++) {
+    result &= conn->writeByte(codes[j]);
+  }
+  if (!conn->endPacket(result)) {
+    return MQTT_ERROR_UNKNOWN;
+  }
+
+  for (byte j=0;j<count;j++) {
+    if (codes[j] != 0x80) {
+      sendRetained(i,slots[j]);
+    }
+  }
+  return MQTT_ERROR_NONE;
+}
+
+byte MQTTBroker::recvUNSUBSCRIBE(byte i, long remainingLength) {
+  MQTTBrokerConnection *conn = &connections[i];
+  char filter[MQTT_MAX_TOPIC_LEN+1];
+  word packetid;
+  word len;
+  long rl;
+
+  if (!conn->readWord(&packetid)) {
+    return MQTT_ERROR_VARHEADER_INVALID;
+  }
+  rl = remainingLength - 2;
+  while (rl > 0) {
+    if (!conn->readWord(&len) || (len > MQTT_MAX_TOPIC_LEN) || !conn->readData(filter,len)) {
+      return MQTT_ERROR_INVALID_SUBSCRIPTION_ENTRIES;
+    }
+    filter[len] = 0;
+    rl -= len + 2;
+    removeSubscription(i,filter);
+  }
+
+  if (!conn->endPacket(conn->writeByte(0xB0) && conn->writeByte(0x02) && conn->writeWord(packetid))) {
+    return MQTT_ERROR_UNKNOWN;
+  }
+  return MQTT_ERROR_NONE;
+}
+
+// Any error is a protocol violation and closes the connection
+byte MQTTBroker::dataAvailable(byte i) {
+  MQTTBrokerConnection *conn = &connections[i];
+  byte b;
+  byte flags;
+  byte packetType;
+  long remainingLength=0;
+  byte result;
+
+  if (conn->stream == NULL) {
+    return MQTT_ERROR_NOT_CONNECTED;
+  }
+
+  if (conn->readByte(&b)) {
+    flags = b & 0x0F;
+    packetType = b >> 4;
+  } else {
+    return MQTT_ERROR_INSUFFICIENT_DATA;
+  }
+  if (!conn->readRemainingLength(&remainingLength)) {
+    closeConnection(i);
+    return MQTT_ERROR_INSUFFICIENT_DATA;
+  }
+  //Serial.print("broker packetType="); Serial.print(packetType); Serial.print(" remainingLength="); Serial.println(remainingLength);
+
+  conn->idleSeconds = 0;
+
+  if (!conn->isConnected && (packetType != ptCONNECT)) {
+    result = MQTT_ERROR_NOT_CONNECTED;
+  } else {
+    switch (packetType) {
+      case ptCONNECT     : result = recvCONNECT(i); break;
+      case ptPUBLISH     : result = recvPUBLISH(i,flags,remainingLength); break;
+      case ptPUBACK      : result = conn->skipData(remainingLength) ? MQTT_ERROR_NONE : MQTT_ERROR_INSUFFICIENT_DATA; break;
+      case ptSUBSCRIBE   : result = recvSUBSCRIBE(i,remainingLength); break;
+      case ptUNSUBSCRIBE : result = recvUNSUBSCRIBE(i,remainingLength); break;
+      case ptPINGREQ     : result = conn->endPacket(conn->writeByte(0xD0) && conn->writeByte(0)) ? MQTT_ERROR_NONE : MQTT_ERROR_UNKNOWN; break;
+      case ptDISCONNECT  : closeConnection(i); return MQTT_ERROR_NONE;
+      default            : result = MQTT_ERROR_UNHANDLED_PACKETTYPE;
+    }
+  }
+
+  if (result != MQTT_ERROR_NONE) {
+    closeConnection(i);
+  }
+  return result;
+}
+
+// Drops connections that have been silent for one and a half keep alive periods
+byte MQTTBroker::intervalTimer() {
+  for (byte i=0;i<MQTT_BROKER_CONNECTIONS;i++) {
+    MQTTBrokerConnection *conn = &connections[i];
+    if ((conn->stream != NULL) && (conn->keepAlive > 0)) {
+      conn->idleSeconds++;
+      if (conn->idleSeconds > conn->keepAlive + conn->keepAlive / 2) {
+        closeConnection(i);
+      }
+    }
+  }
+  return MQTT_ERROR_NONE;
+}
+
+void MQTTBroker::poll() {
+  for (byte i=0;i<MQTT_BROKER_CONNECTIONS;i++) {
+    if (connections[i].stream != NULL) {
+      connections[i].poll();
+    }
+  }
+}
+
+#endif